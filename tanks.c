@@ -1,9 +1,16 @@
+#define _DEFAULT_SOURCE //clock_gettime & friends under -std=c99
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 #include <string.h>
 #include <math.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <enet/enet.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -11,22 +18,178 @@
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 480
 #define TILE_SIZE 16
-#define MAP_WIDTH 40
+#define MAP_WIDTH 40 //Size of the generated map
 #define MAP_HEIGHT 40
+#define MAP_MAX_WIDTH 256 //Sizes the broadphase grid, snapshots adapt to the map
+#define MAP_MAX_HEIGHT 256
+#define MAP_VERSION 1
 #define PLAYER_SIZE 16
-#define PLAYER_SPEED 3
+#define PLAYER_SPEED 3 //Speeds are per tick at the default tick rate
 #define PLAYER_ROTATION_SPEED 3
 #define BULLET_SIZE 4 //Must be an even number
 #define BULLET_SPEED 1
 #define BULLET_AMOUNT 16
 #define BULLET_TIMEOUT 1 //In seconds
-#define PI 3.14159265358979323846
+#define MAX_PLAYERS 64
+#define MAX_PEERS (MAX_PLAYERS - 1) //The host is a player too
+#define STATS_INTERVAL 1000 //In milliseconds
+#define HISTORY_SIZE (TICK_RATE_MAX * REWIND_CAP_MAX / 1000 + 8) //Longest rewind at any tick rate
+#define REWIND_CAP 200 //Default lag compensation cap in milliseconds
+#define REWIND_CAP_MAX 1000 //In milliseconds
+#define FIXED_SHIFT 16 //Simulation positions are Q16.16 fixed point
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define INT_TO_FIXED(x) ((fixed)(x) * FIXED_ONE)
+#define FIXED_TO_INT(x) ((x) >> FIXED_SHIFT) //Rounds down, shifts are arithmetic
+#define FIXED_ROUND(x) FIXED_TO_INT((x) + FIXED_ONE / 2)
+#define FIXED_TO_FLOAT(x) ((float)(x) / FIXED_ONE)
+#define FLOAT_TO_FIXED(x) ((fixed)lroundf((x) * FIXED_ONE))
+#define TICK_RATE 60 //Default simulation ticks per second
+#define TICK_RATE_MIN 10
+#define TICK_RATE_MAX 240
+#define MAX_CATCHUP_TICKS 5 //Ticks run back to back before giving up on pace
+#define IDLE_TIMEOUT 1000 //Headless host wake up interval without players (ms)
+#define FPS_CAP 60 //Default frame rate cap without VSync
+#define GRID_CELL_SIZE 64
+#define EVENT_LOG_SIZE 256 //Must divide 65536 so sequence numbers wrap cleanly
+#define EVENTS_PER_PACKET 64
+#define CONNECT_TIMEOUT 1000 //First attempt in milliseconds, doubled on every retry
+#define CONNECT_ATTEMPTS 5
+#define WELCOME_TIMEOUT 5000 //In milliseconds
+#define FULL_STATE_VERSION 3
+#define HOST_PORT 25565
+#define RELAY_PORT 25566 //Spectators connect to relays here
+#define RELAY_QUEUE_SIZE 4096 //Upstream packets held back by a relay
+#define RELAY_DELAY_MAX 30000 //In milliseconds
+#define NETEM_QUEUE_SIZE 4096 //Packets held back by the network emulator
+#define NETEM_BACKLOG 1000 //Milliseconds queued behind a rate cap before dropping
+#define NETEM_LINKS (MAX_PEERS + 1) //Every peer of a host or relay, & a relay's upstream
+#define SPECTATOR_ID UINT8_MAX //Welcomed id of peers without a player
+#define CONNECT_SPECTATOR 1 //Connect data of read only peers
+#define CONNECT_RELAY 2 //& of relays, fanning the stream out to spectators
+#define CONNECT_COMPRESSION_SHIFT 2 //Connect data bits holding the compression mode
+#define DISCONNECT_COMPRESSION 1 //Disconnect data of a peer compressing differently
+#define DISCONNECT_OVERLOADED 2 //Disconnect data of a peer refused by a busy host
+#define DISCONNECT_FULL 3 //& by a host without a free player id
+#define OVERLOAD_HIGH 0.9 //Share of the tick budget used that counts as an overrun
+#define OVERLOAD_LOW 0.5 //& as recovered
+#define OVERLOAD_EWMA 16 //Smoothing of the tick load, in ticks
+#define FAR_DISTANCE 320 //Pixels from the viewer beyond which detail is cut first
+#define FAR_REFRESH 15 //Ticks between updates of far entities when overloaded
+#define CAPTURE_FROM_HOST 0 //Origin of a captured packet
+#define CAPTURE_FROM_CLIENT 1
+#define CAPTURE_PACKET_MAX (1 << 20) //Larger captured payloads mean the capture is corrupt
+#define BENCH_ROUNDS 16 //Times every captured packet is coded when benchmarking
+#define RECORD_VERSION 1
+#define RECORD_KEYFRAME_INTERVAL 300 //Ticks between full states in a match recording
+#define PEER_BUDGET 32768 //Default bytes per second sent to each peer
+#define PACKET_OVERHEAD 40 //UDP, IP & ENet headers in bytes
+#define SCHEDULE_PERIOD 30 //Ticks between snapshot rate decisions
+#define SNAPSHOT_INTERVAL_MAX 8 //Ticks between snapshots at the lowest rate
+#define SNAPSHOT_REFRESH 30 //Ticks before an unchanged entity is sent again
+#define CONGESTION_LOSS 0.02
+#define CONGESTION_RTT 50 //Milliseconds above the lowest round trip seen
+#define RESYNC_AFTER 30 //Mismatched snapshots before asking for the full state
+#define GRID_WIDTH ((MAP_MAX_WIDTH * TILE_SIZE + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE)
+#define GRID_HEIGHT ((MAP_MAX_HEIGHT * TILE_SIZE + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE)
+
+/* ENUMS */
+enum net_channel {
+  CHANNEL_CONTROL, //Reliable & ordered session messages
+  CHANNEL_STATE, //Unreliable & sequenced snapshots & input
+  CHANNEL_EVENTS, //Gameplay events, repeated until acknowledged
+  CHANNEL_COUNT
+};
+
+enum compression_mode {
+  COMPRESS_NONE,
+  COMPRESS_RANGE, //ENet's adaptive range coder
+  COMPRESS_ZRLE, //Zero run length coding, cheap & suits sparse payloads
+  COMPRESS_COUNT
+};
+
+enum connection_state {
+  CONNECTION_CONNECTING, //Waiting for ENet to connect
+  CONNECTION_JOINING, //Connected, waiting for the welcome
+  CONNECTION_CONNECTED
+};
+
+/* MESSAGE SCHEMA */
+//Every message: flag, channel, delivery, smallest valid size & the handler
+//on the receiving side. Enums, names, routes & dispatch tables expand from here
+#define CLIENT_PACKETS(X) \
+  X(CLIENT_STATE_PACKET, CHANNEL_STATE, 0, \
+    CLIENT_STATE_SIZE, handle_host_packet_state) \
+  X(CLIENT_RESYNC_PACKET, CHANNEL_CONTROL, ENET_PACKET_FLAG_RELIABLE, \
+    sizeof(uint8_t), handle_host_packet_resync)
+
+#define HOST_PACKETS(X) \
+  X(HOST_WELCOME_PACKET, CHANNEL_CONTROL, ENET_PACKET_FLAG_RELIABLE, \
+    3 * sizeof(uint8_t) + FULL_STATE_HEADER_SIZE, handle_client_packet_welcome) \
+  X(HOST_STATE_PACKET, CHANNEL_STATE, 0, \
+    sizeof(uint8_t) + BITS_TO_BYTES(8 + 1), handle_client_packet_state) \
+  X(HOST_PLAYER_JOINED_PACKET, CHANNEL_CONTROL, ENET_PACKET_FLAG_RELIABLE, \
+    PLAYER_JOINED_SIZE, handle_client_packet_player_joined) \
+  X(HOST_PLAYER_LEFT_PACKET, CHANNEL_CONTROL, ENET_PACKET_FLAG_RELIABLE, \
+    PLAYER_LEFT_SIZE, handle_client_packet_player_left) \
+  X(HOST_EVENTS_PACKET, CHANNEL_EVENTS, 0, \
+    sizeof(uint8_t) + BITS_TO_BYTES(16 + 8), handle_client_packet_events) \
+  X(HOST_FULL_STATE_PACKET, CHANNEL_CONTROL, ENET_PACKET_FLAG_RELIABLE, \
+    sizeof(uint8_t) + FULL_STATE_HEADER_SIZE, handle_client_packet_full_state)
+
+//Fixed layout messages, the fields following the flag
+#define CLIENT_STATE_FIELDS(X) \
+  X(uint8_t, up) X(uint8_t, down) X(uint8_t, left) X(uint8_t, right) \
+  X(uint8_t, button_a) X(uint8_t, button_b) X(uint16_t, event_ack)
+#define PLAYER_JOINED_FIELDS(X) X(uint8_t, id) X(uint16_t, pos_x) X(uint16_t, pos_y)
+#define PLAYER_LEFT_FIELDS(X) X(uint8_t, id)
+
+#define PACKET_ENUM(name, channel, flags, min_size, handler) name,
+#define PACKET_NAME(name, channel, flags, min_size, handler) #name,
+#define PACKET_ROUTE(name, channel, flags, min_size, handler) [name] = { channel, flags },
+#define PACKET_DISPATCH(name, channel, flags, min_size, handler) [name] = { min_size, handler },
+#define FIELD_MEMBER(type, name) type name;
+#define FIELD_SIZE(type, name) + sizeof(type)
+#define FIELD_ENCODE(type, name) memcpy(data, &message->name, sizeof(type)); data += sizeof(type);
+#define FIELD_DECODE(type, name) memcpy(&message->name, data, sizeof(type)); data += sizeof(type);
+
+#define CLIENT_STATE_SIZE (sizeof(uint8_t) CLIENT_STATE_FIELDS(FIELD_SIZE))
+#define PLAYER_JOINED_SIZE (sizeof(uint8_t) PLAYER_JOINED_FIELDS(FIELD_SIZE))
+#define PLAYER_LEFT_SIZE (sizeof(uint8_t) PLAYER_LEFT_FIELDS(FIELD_SIZE))
+
+enum client_packet_type {
+  CLIENT_PACKETS(PACKET_ENUM)
+  CLIENT_PACKET_COUNT
+};
+
+enum host_packet_type {
+  HOST_PACKETS(PACKET_ENUM)
+  HOST_PACKET_COUNT
+};
+
+//Host degradation levels, every level keeps the ones below it
+enum overload_level {
+  OVERLOAD_NONE,
+  OVERLOAD_SNAPSHOT_RATE, //Half the snapshot rate
+  OVERLOAD_FAR_DETAIL, //Far entities are updated rarely
+  OVERLOAD_COSMETIC, //Events nobody plays by are dropped
+  OVERLOAD_REFUSE_JOINS,
+  OVERLOAD_COUNT
+};
+
+enum game_event_type {
+  EVENT_NEW_BULLET,
+  EVENT_PLAYER_HIT
+};
 
 /* TYPES */
+typedef int32_t fixed;
+
 typedef struct {
-  float pos_x;
-  float pos_y;
-  struct timeval time_created;
+  fixed pos_x;
+  fixed pos_y;
+  fixed prev_pos_x; //At the start of the tick, for interpolation
+  fixed prev_pos_y;
+  uint16_t ticks; //Age in simulation ticks
   int16_t angle;
   int bounces;
 } Bullet;
@@ -38,13 +201,40 @@ typedef struct {
   int size;
 } Bullet_queue;
 
+typedef struct {
+  uint32_t time;
+  fixed pos_x;
+  fixed pos_y;
+} Position_record;
+
+typedef struct {
+  Position_record records[HISTORY_SIZE];
+  int back;
+  int size;
+} Position_history;
+
+typedef struct {
+  int16_t x0;
+  int16_t y0;
+  int16_t x1;
+  int16_t y1;
+} Grid_range;
+
 typedef struct {
   uint8_t id;
-  float pos_x;
-  float pos_y;
-  int16_t angle;
-  SDL_Texture *texture;
+  fixed pos_x;
+  fixed pos_y;
+  fixed angle; //Degrees, turns keep their fractions at any tick rate
+  fixed prev_pos_x; //At the start of the tick, for interpolation
+  fixed prev_pos_y;
+  fixed prev_angle;
+  uint64_t snapshot_time; //Arrival of the latest snapshot of a remote tank in nanoseconds
+  uint64_t snapshot_interval; //Smoothed time between its snapshots, 0 blends ticks instead
+  uint32_t latency; //Round trip time to the host in milliseconds
   Bullet_queue bullet_queue;
+  Position_history history;
+  Grid_range grid_range; //Cells the player is currently inserted into
+  uint8_t in_grid;
   uint8_t active_bullets;
   uint8_t up;
   uint8_t down;
@@ -56,22 +246,307 @@ typedef struct {
   uint8_t button_b_is_down;
 } Player;
 
+typedef struct {
+  uint8_t *data;
+  size_t size; //In bytes
+  size_t bit;
+} Bit_writer;
+
+typedef struct {
+  const uint8_t *data;
+  size_t size; //In bytes
+  size_t bit;
+  uint8_t overflow; //Set when reading past the end
+} Bit_reader;
+
+typedef struct {
+  float min;
+  float scale; //Steps per unit
+  uint8_t bits;
+} Quant_field;
+
+typedef struct {
+  uint8_t channel;
+  uint32_t flags;
+} Packet_route;
+
+typedef void (*Packet_handler)(uint8_t *, size_t);
+
+typedef struct {
+  size_t min_size; //Anything shorter is dropped before the handler runs
+  Packet_handler handler;
+} Packet_dispatch;
+
+typedef struct { CLIENT_STATE_FIELDS(FIELD_MEMBER) } Client_state_message;
+typedef struct { PLAYER_JOINED_FIELDS(FIELD_MEMBER) } Player_joined_message;
+typedef struct { PLAYER_LEFT_FIELDS(FIELD_MEMBER) } Player_left_message;
+
+typedef struct {
+  uint8_t type;
+  uint8_t player_id; //Shooter
+  uint8_t hit_id;
+  fixed pos_x;
+  fixed pos_y;
+  int16_t angle;
+} Game_event;
+
+typedef struct {
+  uint16_t event_ack; //Last event sequence acknowledged by the peer
+  float budget; //Bytes that can still be sent, refilled every tick
+  uint32_t sent_bytes; //Since the last schedule
+  uint32_t throughput; //Bytes per second over the last schedule
+  uint32_t min_rtt; //In milliseconds
+  uint8_t snapshot_interval; //Ticks between snapshots
+  uint8_t ticks_since_snapshot;
+  uint8_t ticks_since_schedule;
+  uint8_t over_budget; //Entities were left out since the last schedule
+  uint8_t snapshot_entities; //Entities in the last snapshot
+  uint8_t relay; //Serves many spectators, exempt from the per peer budget
+  uint8_t staleness[UINT8_MAX + 1]; //Ticks since an entity was sent, by id
+  uint64_t last_sent[UINT8_MAX + 1]; //Quantized entity state last sent, by id
+} Peer_state;
+
+typedef struct {
+  uint32_t packets;
+  uint32_t bytes;
+} Packet_counter;
+
+typedef struct {
+  Packet_counter sent[UINT8_MAX + 1]; //Indexed by packet flag
+  Packet_counter received[UINT8_MAX + 1];
+  Packet_counter peer_sent[MAX_PEERS]; //Indexed by incomingPeerID
+  Packet_counter peer_received[MAX_PEERS];
+} Host_stats;
+
+typedef struct {
+  Host_stats local; //Of app.server or app.client
+  Host_stats spectators; //Of app.relay_host, its peer ids overlap the client's
+  uint32_t malformed; //Received packets failing the schema
+  uint32_t last_export;
+  FILE *file;
+} Net_stats;
+
+//Match recording header, the map image follows & is 8 byte aligned
+typedef struct {
+  char magic[4];
+  uint8_t version;
+  uint8_t tick_rate;
+  uint16_t reserved;
+  uint32_t keyframe_interval; //In ticks
+  uint32_t map_size;
+} Record_header;
+
+//Ends a closed recording, right after the keyframe index
+typedef struct {
+  uint64_t index_offset; //8 byte aligned
+  uint32_t num_of_keyframes;
+  uint32_t num_of_ticks;
+  char magic[4];
+  uint32_t reserved;
+} Record_trailer;
+
+typedef struct {
+  FILE *file;
+  uint32_t tick; //Ticks recorded so far
+  uint16_t event_seq; //Last event recorded
+  uint64_t last_state[UINT8_MAX + 1]; //Quantized entity state last recorded, by id
+  uint64_t *keyframes; //File offsets of the keyframe records
+  uint32_t num_of_keyframes;
+  uint32_t keyframes_capacity;
+} Recorder;
+
+typedef struct {
+  uint8_t *data; //The whole recording, memory mapped
+  size_t size;
+  size_t end; //Of the records
+  const uint64_t *keyframes; //Offsets of the keyframe records, every interval ticks
+  uint64_t *index; //Set when the index had to be rebuilt
+  uint32_t num_of_keyframes;
+  uint32_t interval;
+  uint32_t num_of_ticks;
+  size_t cursor; //Next record to apply
+  uint32_t tick; //Next tick to apply
+  uint32_t seek; //Tick to start playing from
+  uint64_t start; //In nanoseconds
+} Replay;
+
+typedef struct {
+  uint32_t packets;
+  uint64_t bytes;
+  uint64_t compressed[COMPRESS_COUNT]; //As sent, ENet sends it as is if it doesn't shrink
+  uint64_t encode_ns[COMPRESS_COUNT];
+  uint64_t decode_ns[COMPRESS_COUNT];
+} Bench_counter;
+
+typedef struct {
+  uint16_t x; //In tiles
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+} Map_rect;
+
+typedef struct {
+  uint16_t x; //In pixels
+  uint16_t y;
+} Map_spawn;
+
+//Map file header, sections follow at 8 byte aligned offsets
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint16_t width; //In tiles
+  uint16_t height;
+  uint16_t num_of_rects;
+  uint16_t num_of_spawns;
+  uint16_t reserved;
+  uint32_t tiles_offset; //width * height bytes
+  uint32_t occupancy_offset; //width * height bits, row major
+  uint32_t rects_offset; //Merged wall rectangles
+  uint32_t spawns_offset;
+  uint32_t size; //Of the whole file
+} Map_header;
+
+typedef struct {
+  uint16_t width; //In tiles
+  uint16_t height;
+  const uint8_t *tiles;
+  const uint8_t *occupancy;
+  const Map_rect *rects;
+  uint16_t num_of_rects;
+  const Map_spawn *spawns;
+  uint16_t num_of_spawns;
+  SDL_Rect *walls; //Merged wall rectangles in pixels
+  const uint8_t *image; //Whole map file, sent to clients as is
+  uint32_t image_size;
+  void *mapping; //Set when the image is memory mapped
+  uint8_t *buffer; //Set when the image lives on the heap
+} Map;
+
+typedef struct {
+  uint64_t release; //In nanoseconds
+  uint8_t *data;
+  size_t size;
+} Relay_packet;
+
+typedef struct {
+  Relay_packet packets[RELAY_QUEUE_SIZE];
+  int front;
+  int back;
+  int size;
+} Relay_queue;
+
+typedef struct {
+  uint64_t release; //In nanoseconds
+  ENetPeer *peer;
+  ENetPacket *packet;
+  uint8_t channel;
+  uint32_t sequence; //Of a sequenced unreliable packet, 0 otherwise
+} Netem_packet;
+
+typedef struct {
+  uint8_t enabled;
+  uint32_t latency; //In milliseconds
+  uint32_t jitter; //Extra random latency up to this, in milliseconds
+  float loss; //Chance a packet is dropped
+  uint32_t rate; //Bytes per second of every link, 0 is unlimited
+  uint64_t link_free[NETEM_LINKS]; //When each link is done sending its backlog
+  uint64_t last_reliable[NETEM_LINKS]; //Reliable packets never overtake each other
+  uint32_t sent_sequence[NETEM_LINKS][CHANNEL_COUNT]; //Of sequenced unreliable packets
+  uint32_t released_sequence[NETEM_LINKS][CHANNEL_COUNT]; //Older ones are dropped like ENet does
+  void (*deliver)(ENetPeer *, uint8_t, ENetPacket *);
+  Netem_packet packets[NETEM_QUEUE_SIZE]; //Sorted by release
+  int size;
+} Netem;
+
+typedef struct {
+  uint8_t count;
+  uint8_t players[MAX_PLAYERS]; //Indexes into app.players
+} Grid_cell;
+
+typedef struct {
+  Grid_cell cells[GRID_HEIGHT][GRID_WIDTH];
+  uint32_t visited[MAX_PLAYERS];
+  uint32_t stamp;
+} Grid;
+
+typedef struct {
+  SDL_Texture *texture; //Shared by every sprite of the batch
+  float width;
+  float height;
+  SDL_Vertex vertices[MAX_PLAYERS * 4];
+  int indices[MAX_PLAYERS * 6];
+  int num_of_sprites;
+} Sprite_batch;
+
 typedef struct {
   SDL_Renderer *renderer;
   SDL_Window *window;
+  Sprite_batch tanks;
+  SDL_FRect bullet_rects[MAX_PLAYERS * BULLET_AMOUNT];
+  int num_of_bullet_rects;
   ENetAddress address;
   ENetHost *server;
   ENetHost *client;
+  ENetHost *relay_host; //Spectators of a relay
   ENetEvent event;
   ENetPeer *peer;
   char *ip_address;
+  uint16_t port; //0 picks the default of the role
+  uint16_t upstream_port; //Of the host a relay watches, 0 is HOST_PORT
+  char *stats_path;
+  uint8_t compress; //Compression mode, has to match the host's
+  char *capture_path;
+  FILE *capture; //Payloads of every packet sent & received
+  char *record_path;
+  Recorder recorder; //Match recording of a host
+  Replay replay;
+  float speed; //Of a replay, 0 plays as fast as possible
   int enet_initialized;
-  uint8_t map[MAP_HEIGHT][MAP_WIDTH];
+  Net_stats stats;
+  Peer_state peers[MAX_PEERS]; //Indexed by incoming peer id
+  Game_event events[EVENT_LOG_SIZE]; //Indexed by sequence
+  uint16_t event_seq; //Sequence of the latest event
+  uint16_t event_ack; //Client only, last event applied
+  uint8_t connection_state;
+  uint8_t connect_attempts;
+  uint64_t connect_deadline; //In nanoseconds
+  uint8_t resync_pending;
+  uint8_t snapshot_mismatches; //Consecutive snapshots that disagreed with the roster
+  uint8_t spectate;
+  uint8_t relay;
+  uint32_t relay_delay; //In milliseconds
+  Relay_queue relay_queue;
+  Netem netem_out; //Emulated network conditions of sent packets
+  Netem netem_in; //& of received ones
+  char *map_path;
+  Map map;
+  Quant_field quant_x; //Snapshot positions, sized to the map
+  Quant_field quant_y;
   Player *local_player;
-  Player players[15];
+  Player players[MAX_PLAYERS];
+  Grid grid;
   uint8_t num_of_players;
-  uint8_t current_id;
   uint8_t is_running;
+  uint8_t headless;
+  uint32_t rewind_cap;
+  uint32_t peer_budget; //Bytes per second, 0 is unlimited
+  int tick_timer;
+  uint8_t tick_rate; //Clients take the host's
+  float tick_load; //Smoothed tick time over the tick budget
+  uint8_t overload; //Degradation level of a host
+  uint32_t overload_ticks; //Since the level last changed
+  uint64_t last_tick_end; //In nanoseconds
+  uint64_t blocked_ns; //Spent waiting in poll since the last tick
+  uint64_t next_tick; //Deadline of the next tick in nanoseconds
+  uint8_t vsync;
+  int fps_cap; //0 is uncapped, -1 picks a default
+  uint64_t next_frame; //Deadline of the next frame in nanoseconds
+  uint64_t frame_start;
+  uint64_t frame_report_start;
+  uint32_t frames;
+  uint32_t frames_over_budget;
+  uint64_t frame_time_total;
+  uint64_t frame_time_worst;
   uint8_t up;
   uint8_t down;
   uint8_t left;
@@ -82,587 +557,2851 @@ typedef struct {
   uint8_t button_b_is_down;
 } App;
 
-/* ENUMS */
-enum client_packet_type {
-  CLIENT_STATE_PACKET
-};
-
-enum host_packet_type {
-  HOST_POSITION_PACKET,
-  HOST_MAP_PACKET,
-  HOST_STATE_PACKET,
-  HOST_PLAYER_JOINED_PACKET,
-  HOST_PLAYER_LEFT_PACKET,
-  HOST_PLAYER_HIT_PACKET,
-  HOST_NEW_BULLET_PACKET
-};
-
 /* FUNCTION DEFINITIONS */
 int create_player(Player *, uint8_t, uint16_t, uint16_t);
+void pick_start_position(uint16_t *, uint16_t *);
 int delete_player(uint8_t *);
 void movePlayerForward(Player *);
 void movePlayerBackward(Player *);
-void shoot_bullet(Player *, uint16_t, uint16_t, int16_t);
+void shoot_bullet(Player *);
+void spawn_bullet(Player *, fixed, fixed, int16_t);
 Player *get_player_by_id(uint8_t);
+uint8_t free_player_id();
+void get_player_position_at(Player *, uint32_t, fixed *, fixed *);
+void grid_update_player(Player *);
+void grid_rebuild();
+void relay_clear();
+void relay_receive(uint8_t *, size_t);
+void handle_host_packet_state(uint8_t *, size_t);
+void handle_host_packet_resync(uint8_t *, size_t);
+void handle_client_packet_welcome(uint8_t *, size_t);
+void handle_client_packet_state(uint8_t *, size_t);
+void handle_client_packet_player_joined(uint8_t *, size_t);
+void handle_client_packet_player_left(uint8_t *, size_t);
+void handle_client_packet_events(uint8_t *, size_t);
+void handle_client_packet_full_state(uint8_t *, size_t);
+void relay_release_due();
+void netem_enqueue(Netem *, ENetPeer *, uint8_t, ENetPacket *);
+void capture_packet(uint8_t, uint8_t *, size_t);
+void record_packet(uint8_t *, size_t);
+void finish_record();
+int init_replay(char *);
+void netem_release_due(Netem *);
+void netem_drop_peer(Netem *, ENetPeer *);
+void net_receive(ENetPeer *, uint8_t, ENetPacket *);
+int load_map_image(const uint8_t *, size_t);
+void unload_map();
+void bullet_enqueue(Bullet_queue *, Bullet *);
+uint64_t get_time_ns();
+uint64_t tick_length();
+float get_snapshot_alpha(Player *);
+void blend_previous_snapshot(Player *);
+void update();
+int init_sprite_batch(Sprite_batch *, char *);
+fixed scale_speed(int);
+void turnPlayer(Player *, int);
 
 App app = {0};
 
 void cleanup() {
   if (app.window) SDL_DestroyWindow(app.window);
   if (app.renderer) SDL_DestroyRenderer(app.renderer);
-  if (app.local_player && app.local_player->texture)
-    SDL_DestroyTexture(app.local_player->texture);
+  if (app.tanks.texture) SDL_DestroyTexture(app.tanks.texture);
   if (app.server) enet_host_destroy(app.server);
   if (app.client) enet_host_destroy(app.client);
+  if (app.relay_host) enet_host_destroy(app.relay_host);
+  relay_clear();
   if (app.enet_initialized) enet_deinitialize();
+  if (app.tick_timer > 0) close(app.tick_timer);
+  if (app.stats.file && app.stats.file != stdout) fclose(app.stats.file);
+  if (app.capture) fclose(app.capture);
+  finish_record();
+  unload_map();
+  if (app.replay.data) munmap(app.replay.data, app.replay.size);
+  free(app.replay.index);
 
   SDL_Quit();
 }
 
-/* Enet logic */
-int init_enet() {
-  if (enet_initialize() != 0) {
-    fprintf(stderr, "Failed to initialize Enet.\n");
-    return EXIT_FAILURE;
-  }
+/* Fixed point logic */
+//Sine of 0 to 90 degrees in Q16.16, round(sin(degrees) * 65536)
+const fixed SINE_TABLE[91] = {
+  0, 1144, 2287, 3430, 4572, 5712, 6850, 7987,
+  9121, 10252, 11380, 12505, 13626, 14742, 15855, 16962,
+  18064, 19161, 20252, 21336, 22415, 23486, 24550, 25607,
+  26656, 27697, 28729, 29753, 30767, 31772, 32768, 33754,
+  34729, 35693, 36647, 37590, 38521, 39441, 40348, 41243,
+  42126, 42995, 43852, 44695, 45525, 46341, 47143, 47930,
+  48703, 49461, 50203, 50931, 51643, 52339, 53020, 53684,
+  54332, 54963, 55578, 56175, 56756, 57319, 57865, 58393,
+  58903, 59396, 59870, 60326, 60764, 61183, 61584, 61966,
+  62328, 62672, 62997, 63303, 63589, 63856, 64104, 64332,
+  64540, 64729, 64898, 65048, 65177, 65287, 65376, 65446,
+  65496, 65526, 65536
+};
 
-  app.enet_initialized = 1;
-  return 0;
+fixed fixed_mul(fixed a, fixed b) {
+  return ((int64_t)a * b) >> FIXED_SHIFT;
 }
 
-int init_server() {
-  enet_address_set_host(&app.address, app.ip_address);
-  app.address.port = 25565;
+//Sine of whole degrees, read from a quarter of the wave
+fixed fixed_sin(int32_t angle) {
+  int32_t degrees = ((angle % 360) + 360) % 360;
 
-  app.server = enet_host_create(&app.address, 16, 1, 0, 0);
-  if (app.server == NULL) {
-    fprintf(stderr, "Failed to initialize an Enet server.\n");
-    return EXIT_FAILURE;
-  }
+  if (degrees <= 90) return SINE_TABLE[degrees];
+  if (degrees <= 180) return SINE_TABLE[180 - degrees];
+  if (degrees <= 270) return -SINE_TABLE[degrees - 180];
+  return -SINE_TABLE[360 - degrees];
+}
 
-  printf("Enet server successfully initialized.\n");
-  return 0;
+fixed fixed_cos(int32_t angle) {
+  return fixed_sin(angle + 90);
 }
 
-int init_client() {
-  enet_address_set_host(&app.address, app.ip_address);
-  app.address.port = 25565;
+/* Overload logic */
+const char *overload_names[OVERLOAD_COUNT] = {
+  "none", "snapshot rate", "far detail", "cosmetic events", "refusing joins"
+};
 
-  app.client = enet_host_create(NULL, 1, 1, 0, 0);
-  if (app.client == NULL) {
-    fprintf(stderr, "Failed to initialize an Enet client.\n");
-    return EXIT_FAILURE;
-  }
+//Step the degradation level one at a time & hold each for a second,
+//so a single slow tick doesn't cost anyone anything
+void watch_tick_budget(uint64_t busy_time) {
+  float load = (float)busy_time * app.tick_rate / 1000000000;
+  app.tick_load += (load - app.tick_load) / OVERLOAD_EWMA;
 
-  printf("Enet client successfully initialized.\n");
-  return 0;
+  if (app.overload_ticks < UINT32_MAX) app.overload_ticks++;
+  if (app.overload_ticks < app.tick_rate) return;
+
+  uint8_t level = app.overload;
+  if (app.tick_load > OVERLOAD_HIGH && level < OVERLOAD_COUNT - 1) level++;
+  else if (app.tick_load < OVERLOAD_LOW && level > OVERLOAD_NONE) level--;
+  if (level == app.overload) return;
+
+  printf("Tick load at %.0f%% of the budget, %s to %s.\n", app.tick_load * 100,
+    level > app.overload ? "degrading" : "recovering", overload_names[level]);
+  app.overload = level;
+  app.overload_ticks = 0;
 }
 
-void host_send_position(ENetPeer *peer) {
-  /* PACKET STRUCTURE */
-  /*                |------------*number of players------------|
-  --------------------------------------------------------------
-  |  flag  | num_p  |  p_id  |     pos_x      |     pos_y      |
-  --------------------------------------------------------------
-  */
+/* Telemetry logic */
+const char *host_packet_names[HOST_PACKET_COUNT] = {
+  HOST_PACKETS(PACKET_NAME)
+};
 
-  // Create memory block containing the player positions
-  int sizeof_data = 2 * sizeof(uint8_t);
-  sizeof_data += app.num_of_players * (sizeof(uint8_t) + 2 * sizeof(uint16_t));
-  uint8_t *data = malloc(sizeof_data);
-  ENetPacket *packet;
+const char *client_packet_names[CLIENT_PACKET_COUNT] = {
+  CLIENT_PACKETS(PACKET_NAME)
+};
 
-  data[0] = HOST_POSITION_PACKET;
-  data[1] = app.num_of_players;
-  int position_index = 2;
+int init_stats() {
+  if (!app.stats_path) return 0; //Telemetry is optional
 
-  for (uint8_t i = 0; i < app.num_of_players; i++) {
-    uint16_t id = (uint8_t)app.players[i].id;
-    uint16_t pos_x = (uint16_t)app.players[i].pos_x;
-    uint16_t pos_y = (uint16_t)app.players[i].pos_y;
+  if (strcmp(app.stats_path, "-") == 0) { app.stats.file = stdout; }
+  else { app.stats.file = fopen(app.stats_path, "a"); }
 
-    memcpy(&data[position_index], &id, sizeof(uint8_t));
-    position_index += 1;
-    memcpy(&data[position_index], &pos_x, sizeof(uint16_t));
-    position_index += 2;
-    memcpy(&data[position_index], &pos_y, sizeof(uint16_t));
-    position_index += 2;
+  if (!app.stats.file) {
+    fprintf(stderr, "Failed to open stats file %s.\n", app.stats_path);
+    return EXIT_FAILURE;
   }
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_RELIABLE);
-  enet_peer_send(peer, 0, packet);
-
-  // Cleanup
-  free(data);
+  app.stats.last_export = SDL_GetTicks();
+  return 0;
 }
 
-void host_send_map(ENetPeer *peer) {
-  /* PACKET STRUCTURE */
-  /*
-  -----------------------------------------------------
-  |  flag  |               map_array                  |
-  -----------------------------------------------------
-  */
+void count_packet(Packet_counter *counter, ENetPacket *packet) {
+  counter->packets++;
+  counter->bytes += packet->dataLength;
+}
 
-  // Create memory block containing the map array
-  int sizeof_data = sizeof(uint8_t) + sizeof(app.map);
-  uint8_t *data = malloc(sizeof_data);
-  ENetPacket *packet;
+//Every host counts on its own, a relay's spectators would collide with its upstream
+Host_stats *host_stats(ENetHost *host) {
+  return host && host == app.relay_host ? &app.stats.spectators : &app.stats.local;
+}
 
-  data[0] = HOST_MAP_PACKET;
-  int position_index = 1;
+void stats_count_sent(ENetPeer *peer, ENetPacket *packet) {
+  Host_stats *stats = host_stats(peer->host);
+  if (packet->dataLength == 0) return;
 
-  memcpy(&data[position_index], &app.map, sizeof(app.map));
+  count_packet(&stats->sent[packet->data[0]], packet);
+  if (peer->incomingPeerID < MAX_PEERS)
+    count_packet(&stats->peer_sent[peer->incomingPeerID], packet);
+}
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_RELIABLE);
-  enet_peer_send(peer, 0, packet);
+void stats_count_received(ENetPeer *peer, ENetPacket *packet) {
+  Host_stats *stats = host_stats(peer->host);
+  if (packet->dataLength == 0) return;
 
-  // Cleanup
-  free(data);
+  count_packet(&stats->received[packet->data[0]], packet);
+  if (peer->incomingPeerID < MAX_PEERS)
+    count_packet(&stats->peer_received[peer->incomingPeerID], packet);
 }
 
-void host_send_player_joined() {
-  /* PACKET STRUCTURE
-  --------------------------------------------
-  |  flag  |     pos_x      |     pos_y      |
-  --------------------------------------------
-  */
-
-  // Create memory block containing the player positions
-  int sizeof_data = 2 * sizeof(uint8_t) + 2 * sizeof(uint16_t);
-  uint8_t *data = malloc(sizeof_data);
-  ENetPacket *packet;
+/* Message logic */
+//Encoder & decoder of a fixed layout message, fields are read
+//straight out of the packet buffer
+#define MESSAGE_CODEC(message_type, prefix, flag, fields) \
+  void encode_##prefix(uint8_t *data, const message_type *message) { \
+    *data++ = flag; \
+    fields(FIELD_ENCODE) \
+  } \
+  void decode_##prefix(const uint8_t *data, message_type *message) { \
+    data++; \
+    fields(FIELD_DECODE) \
+  }
 
-  data[0] = HOST_PLAYER_JOINED_PACKET;
-  data[1] = app.players[app.num_of_players - 1].id;
-  int position_index = 2;
+MESSAGE_CODEC(Client_state_message, client_state, CLIENT_STATE_PACKET, CLIENT_STATE_FIELDS)
+MESSAGE_CODEC(Player_joined_message, player_joined, HOST_PLAYER_JOINED_PACKET, PLAYER_JOINED_FIELDS)
+MESSAGE_CODEC(Player_left_message, player_left, HOST_PLAYER_LEFT_PACKET, PLAYER_LEFT_FIELDS)
 
-  uint16_t pos_x = (uint16_t)app.players[app.num_of_players - 1].pos_x;
-  uint16_t pos_y = (uint16_t)app.players[app.num_of_players - 1].pos_y;
+/* Enet routing logic */
+//Channel & delivery of every message, so loss on one stream
+//never stalls another
+const Packet_route host_packet_routes[HOST_PACKET_COUNT] = {
+  HOST_PACKETS(PACKET_ROUTE)
+};
 
-  memcpy(&data[position_index], &pos_x, sizeof(uint16_t));
-  position_index += 2;
-  memcpy(&data[position_index], &pos_y, sizeof(uint16_t));
+const Packet_route client_packet_routes[CLIENT_PACKET_COUNT] = {
+  CLIENT_PACKETS(PACKET_ROUTE)
+};
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_RELIABLE);
-  enet_host_broadcast(app.server, 0, packet);
+//Create a packet routed by its flag (first byte), only clients talk to app.client
+ENetPacket *create_routed_packet(ENetHost *host, uint8_t *data, size_t size,
+                                 uint8_t *channel) {
+  const Packet_route *route = host == app.client ? &client_packet_routes[data[0]]
+                                                 : &host_packet_routes[data[0]];
 
-  // Cleanup
-  free(data);
+  *channel = route->channel;
+  return enet_packet_create(data, size, route->flags);
 }
 
-void host_send_player_left(uint8_t *id) {
-  /* PACKET STRUCTURE
-  -------------------
-  |  flag  |  p_id  |
-  -------------------
-  */
+//Everything a host sends a peer comes out of its budget
+void charge_peer(ENetPeer *peer, size_t size) {
+  if (!app.server || peer->host != app.server || peer->incomingPeerID >= MAX_PEERS) return;
 
-  // Create memory block containing the player id
-  int sizeof_data = 2 * sizeof(uint8_t);
-  uint8_t *data = malloc(sizeof_data);
-  ENetPacket *packet;
+  Peer_state *peer_state = &app.peers[peer->incomingPeerID];
+  if (!peer_state->relay) peer_state->budget -= size + PACKET_OVERHEAD;
+  peer_state->sent_bytes += size + PACKET_OVERHEAD;
+}
 
-  data[0] = HOST_PLAYER_LEFT_PACKET;
-  data[1] = *id;
+//Send a packet to a single peer & account for it
+void net_peer_send(ENetPeer *peer, uint8_t *data, size_t size) {
+  uint8_t channel;
+  ENetPacket *packet = create_routed_packet(peer->host, data, size, &channel);
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_RELIABLE);
-  enet_host_broadcast(app.server, 0, packet);
+  capture_packet(peer->host == app.client ? CAPTURE_FROM_CLIENT : CAPTURE_FROM_HOST, data, size);
 
-  // Cleanup
-  free(data);
+  charge_peer(peer, size);
+  stats_count_sent(peer, packet);
+  if (app.netem_out.enabled) { netem_enqueue(&app.netem_out, peer, channel, packet); }
+  else { enet_peer_send(peer, channel, packet); }
 }
 
-int connect_to_host() {
-  app.peer = enet_host_connect(app.client, &app.address, 1, 0);
-
-  if (app.peer == NULL) {
-    fprintf(stderr, "Peer not found.\n");
-    return EXIT_FAILURE;
+//Broadcast a packet to all connected peers & account for every copy
+void net_host_broadcast(ENetHost *host, uint8_t *data, size_t size) {
+  uint8_t channel;
+  ENetPacket *packet = create_routed_packet(host, data, size, &channel);
+  capture_packet(CAPTURE_FROM_HOST, data, size);
+
+  for (size_t i = 0; i < host->peerCount; i++) {
+    ENetPeer *peer = &host->peers[i];
+    if (peer->state != ENET_PEER_STATE_CONNECTED) continue;
+    charge_peer(peer, size);
+    stats_count_sent(peer, packet);
+
+    //Every link gets its own conditions, so its own copy
+    if (app.netem_out.enabled) {
+      netem_enqueue(&app.netem_out, peer, channel,
+                    enet_packet_create(data, size, packet->flags));
+    }
   }
 
-  int res = enet_host_service(app.client, &app.event, 5000);
-  if (res > 0 && app.event.type == ENET_EVENT_TYPE_CONNECT) {
-    printf("Successfully connected to host.\n");
+  if (app.netem_out.enabled) { enet_packet_destroy(packet); }
+  else { enet_host_broadcast(host, channel, packet); }
+}
 
-    return 0;
-  }
-  else {
-    enet_peer_reset(app.peer);
+void write_stats_counters(Packet_counter *counters, const char **names,
+                          int num_of_names) {
+  uint8_t first = 1;
 
-    fprintf(stderr, "Failed to connect to host.\n");
-    return EXIT_FAILURE;
-  }
-}
+  fputc('{', app.stats.file);
+  for (int i = 0; i <= UINT8_MAX; i++) {
+    if (!counters[i].packets) continue;
 
-int host_or_join(char **argv) {
-  char *err_msg = "Use the following format:\n"
-                  "%s < host <local | online <ip> > | join >\n";
-  if (!argv[1]) {
-    fprintf(stderr, err_msg, argv[0]);
-    return EXIT_FAILURE;
+    if (!first) fputc(',', app.stats.file);
+    if (i < num_of_names) { fprintf(app.stats.file, "\"%s\":", names[i]); }
+    else { fprintf(app.stats.file, "\"%d\":", i); } //Unknown packet flag
+
+    fprintf(app.stats.file, "{\"packets\":%u,\"bytes\":%u}",
+      counters[i].packets, counters[i].bytes);
+    first = 0;
   }
+  fputc('}', app.stats.file);
+}
 
-  if (strcmp(argv[1], "host") == 0) {
-    if (!argv[2]) { app.ip_address = "127.0.0.1"; }
-    else if (strcmp(argv[2], "local") == 0) { app.ip_address = "127.0.0.1"; }
-    else if (strcmp(argv[2], "online") == 0) {
-      if (!argv[3]) {
-        fprintf(stderr, err_msg, argv[0]);
-        return EXIT_FAILURE;
-      }
-      app.ip_address = argv[3];
-    }
-    else {
-      fprintf(stderr, err_msg, argv[0]);
-      return EXIT_FAILURE;
+void write_stats_peers(ENetHost *host, Host_stats *stats) {
+  uint8_t first = 1;
+
+  fputc('[', app.stats.file);
+  for (size_t i = 0; i < host->peerCount && i < MAX_PEERS; i++) {
+    ENetPeer *peer = &host->peers[i];
+    if (peer->state != ENET_PEER_STATE_CONNECTED) continue;
+
+    if (!first) fputc(',', app.stats.file);
+    fprintf(app.stats.file, "{\"peer\":%u", peer->incomingPeerID);
+    if (app.server && peer->data)
+      fprintf(app.stats.file, ",\"player\":%u", *(uint8_t *)peer->data);
+
+    if (app.server) {
+      Peer_state *peer_state = &app.peers[i];
+      fprintf(app.stats.file,
+        ",\"snapshot_interval\":%u,\"snapshot_entities\":%u,\"throughput\":%u",
+        peer_state->snapshot_interval, peer_state->snapshot_entities,
+        peer_state->throughput);
     }
-    return init_server();
-  }
-  else if (strcmp(argv[1], "join") == 0) {
-    if (!argv[2]) { app.ip_address = "127.0.0.1"; }
-    else { app.ip_address = argv[2]; }
 
-    if (init_client() == EXIT_FAILURE) { return EXIT_FAILURE; }
-    return connect_to_host();
-  }
-  else {
-    fprintf(stderr, err_msg, argv[0]);
-    return EXIT_FAILURE;
+    fprintf(app.stats.file,
+      ",\"rtt\":%u,\"rtt_var\":%u,\"loss\":%.4f,\"throttle\":%u"
+      ",\"sent\":{\"packets\":%u,\"bytes\":%u}"
+      ",\"received\":{\"packets\":%u,\"bytes\":%u}}",
+      peer->roundTripTime, peer->roundTripTimeVariance,
+      (double)peer->packetLoss / ENET_PEER_PACKET_LOSS_SCALE,
+      peer->packetThrottle,
+      stats->peer_sent[i].packets, stats->peer_sent[i].bytes,
+      stats->peer_received[i].packets, stats->peer_received[i].bytes);
+    first = 0;
   }
+  fputc(']', app.stats.file);
 }
 
-void handle_host_event_connect() {
-  printf("New client connected from %x:%u.\n",
-    app.event.peer->address.host, app.event.peer->address.port);
-
-  //Assign ID to client CHECK IF DATA GETS FREED AFTER PEER DISCONNECTS!!
-  //ASK ON IRC?
-  app.event.peer->data = malloc(sizeof(uint8_t));
-  memcpy(app.event.peer->data, &app.current_id, sizeof(uint8_t));
-
-  //Create player
-  Player *player = &app.players[app.num_of_players];
-  uint8_t res = create_player(player, app.current_id, 0, 0);
-  if (res == EXIT_FAILURE) { exit(EXIT_FAILURE); }
-
-  host_send_position(app.event.peer); //Send player position to client
-  host_send_map(app.event.peer); //Send map to client
-  host_send_player_joined(); //Broadcast player joined to all
+//Write the counters of one host & reset them for the next interval
+void write_stats_host(ENetHost *host, uint8_t serving) {
+  Host_stats *stats = host_stats(host);
+  const char **sent_names = serving ? host_packet_names : client_packet_names;
+  const char **received_names = serving ? client_packet_names : host_packet_names;
+  int sent_count = serving ? HOST_PACKET_COUNT : CLIENT_PACKET_COUNT;
+  int received_count = serving ? CLIENT_PACKET_COUNT : HOST_PACKET_COUNT;
+
+  //Wire totals include ENet protocol overhead, per type counters are payload
+  fprintf(app.stats.file,
+    "\"wire\":{\"sent_packets\":%u,\"sent_bytes\":%u"
+    ",\"received_packets\":%u,\"received_bytes\":%u},\"sent\":",
+    host->totalSentPackets, host->totalSentData,
+    host->totalReceivedPackets, host->totalReceivedData);
+  write_stats_counters(stats->sent, sent_names, sent_count);
+  fprintf(app.stats.file, ",\"received\":");
+  write_stats_counters(stats->received, received_names, received_count);
+  fprintf(app.stats.file, ",\"peers\":");
+  write_stats_peers(host, stats);
+
+  memset(stats, 0, sizeof(*stats));
+  host->totalSentPackets = 0;
+  host->totalSentData = 0;
+  host->totalReceivedPackets = 0;
+  host->totalReceivedData = 0;
 }
 
-void handle_host_event_receive() {
-  uint8_t *data = (uint8_t *)app.event.packet->data;
-
-  if (data[0] == CLIENT_STATE_PACKET) {
-    uint8_t *player_ID = (uint8_t *)app.event.peer->data;
-    Player *player = get_player_by_id(*player_ID);
-
-    if (data[1]) { movePlayerForward(player); };
-    if (data[2]) { movePlayerBackward(player); };
-    if (data[3]) { player->angle -= PLAYER_ROTATION_SPEED; };
-    if (data[4]) { player->angle += PLAYER_ROTATION_SPEED; };
-    if (data[5] && !player->button_a_is_down) {
-      shoot_bullet(player, 0, 0, 0);
-      player->button_a_is_down = 1;
-    };
-    if (!data[5] && player->button_a_is_down) { player->button_a_is_down = 0; };
+//Write one JSON line per STATS_INTERVAL & reset the interval counters
+void export_stats() {
+  ENetHost *host = app.server ? app.server : app.client;
+  uint32_t now = SDL_GetTicks();
+
+  if (!app.stats.file || !host) return;
+  if (now - app.stats.last_export < STATS_INTERVAL) return;
+
+  fprintf(app.stats.file, "{\"time\":%u,\"interval\":%u,\"role\":\"%s\",",
+    now, now - app.stats.last_export,
+    app.server ? "host" : app.relay ? "relay" : "client");
+  write_stats_host(host, app.server != NULL);
+  //A relay serves its spectators like a host does
+  if (app.relay_host) {
+    fprintf(app.stats.file, ",\"spectators\":{");
+    write_stats_host(app.relay_host, 1);
+    fputc('}', app.stats.file);
+  }
+  fprintf(app.stats.file, ",\"malformed\":%u", app.stats.malformed);
+  if (app.server) {
+    fprintf(app.stats.file, ",\"tick_load\":%.3f,\"overload\":\"%s\"",
+      app.tick_load, overload_names[app.overload]);
   }
+  fprintf(app.stats.file, "}\n");
+  fflush(app.stats.file);
+
+  app.stats.malformed = 0;
+  app.stats.last_export = now;
 }
 
-void handle_host_event_disconnect() {
-  printf("Client disconnected from %x:%u.\n",
-    app.event.peer->address.host, app.event.peer->address.port);
+/* Bit stream logic */
+//Quantization schema shared by host & client
+const Quant_field QUANT_ANGLE = { 0, 1, 9 }; //Degrees in [0, 360)
+const Quant_field QUANT_ID = { 0, 1, 8 };
 
-  host_send_player_left(app.event.peer->data);
-  uint8_t res = delete_player(app.event.peer->data);
-  if ( res == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+#define SNAPSHOT_PLAYER_BITS (app.quant_x.bits + app.quant_y.bits + QUANT_ANGLE.bits)
+#define QUANT_MARGIN 64 //Pixels off the map positions can still be sent at
+
+//Half pixels along one axis of the map, wide enough to cover all of it
+Quant_field position_field(uint32_t pixels) {
+  Quant_field field = { -QUANT_MARGIN, 2, 1 };
+
+  while ((1u << field.bits) < (pixels + 2 * QUANT_MARGIN) * field.scale) field.bits++;
+  return field;
 }
+#define BITS_TO_BYTES(bits) (((bits) + 7) / 8)
 
-void poll_enet_host() {
-  while (enet_host_service(app.server, &app.event, 0) > 0) {
-    switch (app.event.type) {
-      case ENET_EVENT_TYPE_CONNECT:
-        handle_host_event_connect();
-        break;
-      case ENET_EVENT_TYPE_RECEIVE:
-        handle_host_event_receive();
-        break;
-      case ENET_EVENT_TYPE_DISCONNECT:
-        handle_host_event_disconnect();
-        break;
-      case ENET_EVENT_TYPE_NONE:
-        break;
-    }
+void write_bits(Bit_writer *writer, uint32_t value, uint8_t bits) {
+  for (uint8_t i = 0; i < bits; i++) {
+    if (writer->bit / 8 >= writer->size) return;
+
+    uint8_t *byte = &writer->data[writer->bit / 8];
+    if (writer->bit % 8 == 0) *byte = 0;
+    *byte |= ((value >> i) & 1) << (writer->bit % 8);
+    writer->bit++;
   }
 }
 
-void handle_client_packet_position(uint8_t *data) {
-  uint8_t num_of_players = data[1];
-  int data_index = 2;
-
-  //Create players
-  for (uint8_t i = 0; i < num_of_players; i++) {
-    uint8_t id;
-    uint16_t pos_x;
-    uint16_t pos_y;
+uint32_t read_bits(Bit_reader *reader, uint8_t bits) {
+  uint32_t value = 0;
 
-    memcpy(&id, &data[data_index], sizeof(uint8_t));
-    data_index += 1;
-    memcpy(&pos_x, &data[data_index], sizeof(uint16_t));
-    data_index += 2;
-    memcpy(&pos_y, &data[data_index], sizeof(uint16_t));
-    data_index += 2;
+  for (uint8_t i = 0; i < bits; i++) {
+    if (reader->bit / 8 >= reader->size) {
+      reader->overflow = 1;
+      return 0;
+    }
 
-    uint8_t res = create_player(&app.players[i], id, pos_x, pos_y);
-    if (res == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+    uint8_t bit = (reader->data[reader->bit / 8] >> (reader->bit % 8)) & 1;
+    value |= (uint32_t)bit << i;
+    reader->bit++;
   }
 
-  //Last player in app.players is local_player
-  app.local_player = &app.players[app.num_of_players - 1];
-  printf("Your id is: %d\n", app.local_player->id);
+  return value;
 }
 
-void handle_client_packet_map(uint8_t *data) {
-    int data_index = 1;
+//Round to the nearest step & clamp to the range of the field
+uint32_t quantize(const Quant_field *field, float value) {
+  uint32_t max = (1u << field->bits) - 1;
+  float steps = roundf((value - field->min) * field->scale);
 
-    //Copy map data
-    memcpy(&app.map, &data[data_index], MAP_HEIGHT * MAP_WIDTH);
+  if (steps < 0) steps = 0;
+  if (steps > max) steps = max;
+  return (uint32_t)steps;
 }
 
-void handle_client_packet_state(uint8_t *data) {
-  int data_index = 1;
+void write_quantized(Bit_writer *writer, const Quant_field *field, float value) {
+  write_bits(writer, quantize(field, value), field->bits);
+}
 
-  for (uint8_t i = 0; i < app.num_of_players; i++) {
-    //Update player positions
-    uint16_t pos_x;
-    uint16_t pos_y;
-    int16_t angle;
-    memcpy(&pos_x, &data[data_index], sizeof(uint16_t));
-    data_index += 2;
-    memcpy(&pos_y, &data[data_index], sizeof(uint16_t));
-    data_index += 2;
-    memcpy(&angle, &data[data_index], sizeof(int16_t));
-    data_index += 2;
-
-    app.players[i].pos_x = pos_x;
-    app.players[i].pos_y = pos_y;
-    app.players[i].angle = angle;
-  }
-}
-
-void handle_client_packet_player_joined(uint8_t *data) {
-  uint8_t id = data[1];
-  uint8_t data_index = 2;
-  uint16_t pos_x;
-  uint16_t pos_y;
-
-  //When a new player joins they receive a HOST_POSITION_PACKET
-  //packet privately & HOST_PLAYER_JOINED_PACKET packet via broadcast
-  //so they need to ignore the HOST_PLAYER_JOINED_PACKET
-  if (get_player_by_id(id)) return;
+float read_quantized(Bit_reader *reader, const Quant_field *field) {
+  return field->min + read_bits(reader, field->bits) / field->scale;
+}
 
-  memcpy(&pos_x, &data[data_index], sizeof(uint16_t));
-  data_index += 2;
-  memcpy(&pos_y, &data[data_index], sizeof(uint16_t));
+void write_angle(Bit_writer *writer, int16_t angle) {
+  write_quantized(writer, &QUANT_ANGLE, ((angle % 360) + 360) % 360);
+}
 
-  Player *player = &app.players[app.num_of_players];
-  uint8_t res = create_player(player, id, pos_x, pos_y);
-  if (res == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+int16_t read_angle(Bit_reader *reader) {
+  return read_quantized(reader, &QUANT_ANGLE);
+}
+
+/* Event logic */
+#define EVENT_TYPE_BITS 2
+
+void write_event(Bit_writer *writer, Game_event *event) {
+  write_bits(writer, event->type, EVENT_TYPE_BITS);
+  write_quantized(writer, &QUANT_ID, event->player_id);
+
+  if (event->type == EVENT_NEW_BULLET) {
+    write_quantized(writer, &app.quant_x, FIXED_TO_FLOAT(event->pos_x));
+    write_quantized(writer, &app.quant_y, FIXED_TO_FLOAT(event->pos_y));
+    write_angle(writer, event->angle);
+  }
+  else if (event->type == EVENT_PLAYER_HIT) {
+    write_quantized(writer, &QUANT_ID, event->hit_id);
+  }
 }
 
-void handle_client_packet_player_left(uint8_t *data) {
-  uint8_t id = data[1];
-  if (delete_player(&id) == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+void read_event(Bit_reader *reader, Game_event *event) {
+  memset(event, 0, sizeof(Game_event));
+  event->type = read_bits(reader, EVENT_TYPE_BITS);
+  event->player_id = read_quantized(reader, &QUANT_ID);
+
+  if (event->type == EVENT_NEW_BULLET) {
+    event->pos_x = FLOAT_TO_FIXED(read_quantized(reader, &app.quant_x));
+    event->pos_y = FLOAT_TO_FIXED(read_quantized(reader, &app.quant_y));
+    event->angle = read_angle(reader);
+  }
+  else if (event->type == EVENT_PLAYER_HIT) {
+    event->hit_id = read_quantized(reader, &QUANT_ID);
+  }
 }
 
-void handle_client_packet_player_hit(uint8_t *data) {
-  uint8_t id_hit = data[1];
-  uint8_t id_shooter = data[2];
+//Append an event to the log, it's sent with the next flush
+void queue_event(Game_event *event) {
+  app.event_seq++;
+  app.events[app.event_seq % EVENT_LOG_SIZE] = *event;
+}
 
-  printf("Player %d was shot by player %d\n", id_hit, id_shooter);
+void queue_event_new_bullet(Player *player, Bullet *bullet) {
+  Game_event event = { EVENT_NEW_BULLET, player->id, 0,
+                       bullet->pos_x, bullet->pos_y, bullet->angle };
+  queue_event(&event);
 }
 
-void handle_client_packet_new_bullet(uint8_t *data) {
-  uint8_t id = data[1];
-  uint8_t data_index = 2;
-  uint16_t pos_x;
-  uint16_t pos_y;
-  int16_t angle;
+void queue_event_player_hit(Player *p_hit, Player *p_shooter) {
+  if (app.overload >= OVERLOAD_COSMETIC) return; //Only shown, never played by
+
+  Game_event event = { EVENT_PLAYER_HIT, p_shooter->id, p_hit->id };
+  queue_event(&event);
+}
 
-  if (id == app.local_player->id) return; //Ignore if own bullet
-  Player *player = get_player_by_id(id);
+//Take a newer acknowledgement from a peer, ignoring stale & bogus ones
+void ack_events(Peer_state *peer_state, uint16_t ack) {
+  int16_t ahead_of_ack = ack - peer_state->event_ack;
+  int16_t behind_latest = app.event_seq - ack;
 
-  memcpy(&pos_x, &data[data_index], sizeof(uint16_t));
-  data_index += 2;
-  memcpy(&pos_y, &data[data_index], sizeof(uint16_t));
+  if (ahead_of_ack > 0 && behind_latest >= 0) peer_state->event_ack = ack;
+}
+
+/* Full state logic */
+/* BLOCK STRUCTURE
+----------------------------------------------------
+| version|   event_seq    | num_p  |    players    |
+----------------------------------------------------
+Every player is sent as, positions & its angle in Q16.16
+---------------------------------------------------------------------------------------------------
+|  p_id  |           pos_x           |           pos_y           |           angle           | num_b  |
+---------------------------------------------------------------------------------------------------
+followed by its bullets in flight
+---------------------------------------------------------------------------------------
+|           pos_x           |           pos_y           |     angle      | age (ticks)  |
+---------------------------------------------------------------------------------------
+*/
+#define FULL_STATE_HEADER_SIZE (2 * sizeof(uint8_t) + sizeof(uint16_t))
+#define FULL_STATE_PLAYER_SIZE (2 * sizeof(uint8_t) + 3 * sizeof(fixed))
+#define FULL_STATE_BULLET_SIZE (2 * sizeof(fixed) + 2 * sizeof(uint16_t))
+
+size_t full_state_size() {
+  size_t size = FULL_STATE_HEADER_SIZE;
+
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    size += FULL_STATE_PLAYER_SIZE;
+    size += app.players[i].bullet_queue.size * FULL_STATE_BULLET_SIZE;
+  }
+
+  return size;
+}
+
+//Write the complete state of every entity, returns the bytes written
+size_t write_full_state(uint8_t *data) {
+  size_t data_index = 0;
+
+  data[data_index++] = FULL_STATE_VERSION;
+  memcpy(&data[data_index], &app.event_seq, sizeof(uint16_t));
   data_index += 2;
-  memcpy(&angle, &data[data_index], sizeof(int16_t));
+  data[data_index++] = app.num_of_players;
+
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    Player *player = &app.players[i];
+
+    data[data_index++] = player->id;
+    memcpy(&data[data_index], &player->pos_x, sizeof(fixed));
+    data_index += 4;
+    memcpy(&data[data_index], &player->pos_y, sizeof(fixed));
+    data_index += 4;
+    memcpy(&data[data_index], &player->angle, sizeof(fixed));
+    data_index += 4;
+    data[data_index++] = player->bullet_queue.size;
+
+    for (int j = 0; j < player->bullet_queue.size; j++) {
+      int index = (player->bullet_queue.front + j) % BULLET_AMOUNT;
+      Bullet *bullet = &player->bullet_queue.bullets[index];
+
+      memcpy(&data[data_index], &bullet->pos_x, sizeof(fixed));
+      data_index += 4;
+      memcpy(&data[data_index], &bullet->pos_y, sizeof(fixed));
+      data_index += 4;
+      memcpy(&data[data_index], &bullet->angle, sizeof(int16_t));
+      data_index += 2;
+      memcpy(&data[data_index], &bullet->ticks, sizeof(uint16_t));
+      data_index += 2;
+    }
+  }
 
-  shoot_bullet(player, pos_x, pos_y, angle);
+  return data_index;
 }
 
-void handle_client_event_receive() {
-  uint8_t *data = (uint8_t *)app.event.packet->data;
+//Walk a full state block without touching the roster, returns its size or -1
+int check_full_state(const uint8_t *data, size_t size) {
+  uint8_t seen[UINT8_MAX + 1] = {0};
+  size_t data_index = FULL_STATE_HEADER_SIZE;
+
+  if (size < FULL_STATE_HEADER_SIZE) return -1;
+  if (data[0] != FULL_STATE_VERSION) {
+    fprintf(stderr, "Host sent full state version %u, expected %u.\n",
+      data[0], FULL_STATE_VERSION);
+    return -1;
+  }
 
-  if (data[0] == HOST_POSITION_PACKET) handle_client_packet_position(data);
-  else if (data[0] == HOST_MAP_PACKET) handle_client_packet_map(data);
-  else if (data[0] == HOST_STATE_PACKET) handle_client_packet_state(data);
-  else if (data[0] == HOST_PLAYER_JOINED_PACKET) handle_client_packet_player_joined(data);
-  else if (data[0] == HOST_PLAYER_LEFT_PACKET) handle_client_packet_player_left(data);
-  else if (data[0] == HOST_PLAYER_HIT_PACKET) handle_client_packet_player_hit(data);
-  else if (data[0] == HOST_NEW_BULLET_PACKET) handle_client_packet_new_bullet(data);
+  uint8_t num_of_players = data[FULL_STATE_HEADER_SIZE - 1];
+  if (num_of_players > MAX_PLAYERS) return -1;
+
+  for (uint8_t i = 0; i < num_of_players; i++) {
+    if (size < data_index + FULL_STATE_PLAYER_SIZE) return -1;
+
+    uint8_t id = data[data_index];
+    uint8_t num_of_bullets = data[data_index + FULL_STATE_PLAYER_SIZE - 1];
+    if (id == SPECTATOR_ID || seen[id]++) return -1;
+    if (num_of_bullets > BULLET_AMOUNT) return -1;
+
+    data_index += FULL_STATE_PLAYER_SIZE + num_of_bullets * FULL_STATE_BULLET_SIZE;
+    if (size < data_index) return -1;
+  }
+
+  return data_index;
 }
 
-void poll_enet_client() {
-  while (enet_host_service(app.client, &app.event, 0) > 0) {
-    switch (app.event.type) {
-      case ENET_EVENT_TYPE_CONNECT:
-        break;
-      case ENET_EVENT_TYPE_RECEIVE:
-        handle_client_event_receive();
-        break;
-      case ENET_EVENT_TYPE_DISCONNECT:
-        printf("Player %d disconnected.\n", *(uint8_t *)app.event.peer->data);
-        break;
-      case ENET_EVENT_TYPE_NONE:
-        break;
+//Replace the roster with a full state block, returns the bytes read or -1.
+//A block that doesn't check out leaves the roster alone
+int apply_full_state(const uint8_t *data, size_t size) {
+  size_t data_index = 1;
+
+  if (check_full_state(data, size) < 0) return -1;
+
+  memcpy(&app.event_ack, &data[data_index], sizeof(uint16_t)); //Events start after this one
+  data_index += 2;
+  uint8_t num_of_players = data[data_index++];
+
+  app.num_of_players = 0;
+  app.local_player = NULL; //Callers look it up again by id
+  grid_rebuild();
+
+  //Create players & their bullets in flight
+  for (uint8_t i = 0; i < num_of_players; i++) {
+    fixed pos_x;
+    fixed pos_y;
+    fixed angle;
+
+    uint8_t id = data[data_index++];
+    memcpy(&pos_x, &data[data_index], sizeof(fixed));
+    data_index += 4;
+    memcpy(&pos_y, &data[data_index], sizeof(fixed));
+    data_index += 4;
+    memcpy(&angle, &data[data_index], sizeof(fixed));
+    data_index += 4;
+    uint8_t num_of_bullets = data[data_index++];
+
+    //Restore the exact position, not just the pixel it's on
+    Player *player = &app.players[i];
+    uint8_t res = create_player(player, id, FIXED_TO_INT(pos_x), FIXED_TO_INT(pos_y));
+    if (res == EXIT_FAILURE) return -1;
+    player->pos_x = player->prev_pos_x = pos_x;
+    player->pos_y = player->prev_pos_y = pos_y;
+    player->angle = angle;
+    player->prev_angle = angle;
+    grid_update_player(player);
+
+    for (uint8_t j = 0; j < num_of_bullets; j++) {
+      Bullet bullet = {0};
+
+      memcpy(&bullet.pos_x, &data[data_index], sizeof(fixed));
+      data_index += 4;
+      memcpy(&bullet.pos_y, &data[data_index], sizeof(fixed));
+      data_index += 4;
+      memcpy(&bullet.angle, &data[data_index], sizeof(int16_t));
+      data_index += 2;
+      memcpy(&bullet.ticks, &data[data_index], sizeof(uint16_t));
+      data_index += 2;
+
+      bullet.prev_pos_x = bullet.pos_x;
+      bullet.prev_pos_y = bullet.pos_y;
+      bullet_enqueue(&player->bullet_queue, &bullet);
+    }
+  }
+
+  app.resync_pending = 0;
+  app.snapshot_mismatches = 0;
+  return data_index;
+}
+
+/* Compression logic */
+const char *compression_names[COMPRESS_COUNT] = { "none", "range", "zrle" };
+
+//Every zero byte is followed by how many more zeros come right after it
+size_t zrle_compress(void *context, const ENetBuffer *in_buffers, size_t in_buffer_count,
+                     size_t in_limit, enet_uint8 *out_data, size_t out_limit) {
+  size_t out = 0;
+  uint8_t in_run = 0;
+  uint8_t run = 0;
+
+  for (size_t i = 0; i < in_buffer_count; i++) {
+    const uint8_t *data = in_buffers[i].data;
+
+    for (size_t j = 0; j < in_buffers[i].dataLength; j++) {
+      if (in_run) {
+        if (data[j] == 0 && run < UINT8_MAX) { run++; continue; }
+        if (out == out_limit) return 0;
+        out_data[out++] = run;
+        in_run = 0;
+      }
+
+      if (out == out_limit) return 0; //Not worth it, ENet sends it as is
+      out_data[out++] = data[j];
+      if (data[j] == 0) { in_run = 1; run = 0; }
     }
   }
+
+  if (in_run) {
+    if (out == out_limit) return 0;
+    out_data[out++] = run;
+  }
+  return out;
 }
 
-void poll_enet() {
-  if (app.server) { poll_enet_host(); }
-  else if (app.client) { poll_enet_client(); }
+size_t zrle_decompress(void *context, const enet_uint8 *in_data, size_t in_limit,
+                       enet_uint8 *out_data, size_t out_limit) {
+  size_t out = 0;
+
+  for (size_t i = 0; i < in_limit; i++) {
+    if (out == out_limit) return 0;
+    out_data[out++] = in_data[i];
+    if (in_data[i]) continue;
+
+    if (++i == in_limit || out_limit - out < in_data[i]) return 0; //Corrupt
+    memset(&out_data[out], 0, in_data[i]);
+    out += in_data[i];
+  }
+
+  return out;
 }
 
-void send_enet_host_state() {
-  /* PACKET STRUCTURE */
-  /*       |----------------*number of players----------------|
-  -------------------------------------------------------------
-  |  flag  |     pos_x      |     pos_y      |     angle      |
-  -------------------------------------------------------------
-  */
+int parse_compression(char *name) {
+  for (int i = 0; i < COMPRESS_COUNT; i++) {
+    if (strcmp(name, compression_names[i]) == 0) return i;
+  }
 
-  // Create memory block containing all player positions
-  int sizeof_data = sizeof(uint8_t) + 3 * app.num_of_players * sizeof(uint16_t);
-  uint8_t *data = malloc(sizeof_data);
-  uint8_t data_index = 1;
-  ENetPacket *packet;
+  fprintf(stderr, "Unknown compression %s, use none, range or zrle.\n", name);
+  return -1;
+}
 
-  data[0] = HOST_STATE_PACKET;
+//ENet takes a compressor without a context for none at all
+uint8_t zrle_context;
 
-  for (uint8_t i = 0; i < app.num_of_players; i++) {
-    uint16_t pos_x = app.players[i].pos_x;
-    uint16_t pos_y = app.players[i].pos_y;
-    int16_t angle = app.players[i].angle;
+//Both ends of a connection have to agree on the compressor
+int set_compression(ENetHost *host) {
+  if (app.compress == COMPRESS_RANGE && enet_host_compress_with_range_coder(host) < 0) {
+    fprintf(stderr, "Failed to set up the range coder.\n");
+    return EXIT_FAILURE;
+  }
+  if (app.compress == COMPRESS_ZRLE) {
+    ENetCompressor compressor = { &zrle_context, zrle_compress, zrle_decompress, NULL };
+    enet_host_compress(host, &compressor);
+  }
+
+  return 0;
+}
+
+int init_capture() {
+  if (!app.capture_path) return 0; //Capturing is optional
+
+  app.capture = fopen(app.capture_path, "wb");
+  if (!app.capture) {
+    fprintf(stderr, "Failed to open capture file %s.\n", app.capture_path);
+    return EXIT_FAILURE;
+  }
 
-    memcpy(&data[data_index], &pos_x, sizeof(uint16_t));
-    data_index += 2;
-    memcpy(&data[data_index], &pos_y, sizeof(uint16_t));
-    data_index += 2;
-    memcpy(&data[data_index], &angle, sizeof(int16_t));
-    data_index += 2;
+  return 0;
+}
+
+/* CAPTURE STRUCTURE
+------------------------------------------------
+| origin |           size            | payload ...
+------------------------------------------------
+*/
+void capture_packet(uint8_t origin, uint8_t *data, size_t size) {
+  if (!app.capture || size > CAPTURE_PACKET_MAX) return; //Benchmarks would take it as corrupt
+
+  uint32_t size_u32 = size;
+  fwrite(&origin, sizeof(uint8_t), 1, app.capture);
+  fwrite(&size_u32, sizeof(uint32_t), 1, app.capture);
+  fwrite(data, 1, size, app.capture);
+}
+
+//Code one payload BENCH_ROUNDS times, return the size ENet would send.
+//Both scratch buffers hold at least size bytes
+size_t bench_packet(uint8_t mode, void *range_coder, uint8_t *data, size_t size,
+                    uint8_t *compressed, uint8_t *decompressed, Bench_counter *counter) {
+  ENetBuffer buffer = { data, size };
+  size_t compressed_size = 0;
+  size_t decompressed_size = 0;
+
+  uint64_t start = get_time_ns();
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    if (mode == COMPRESS_RANGE) {
+      compressed_size = enet_range_coder_compress(range_coder, &buffer, 1, size, compressed, size);
+    }
+    else { compressed_size = zrle_compress(NULL, &buffer, 1, size, compressed, size); }
+  }
+  counter->encode_ns[mode] += (get_time_ns() - start) / BENCH_ROUNDS;
+  if (!compressed_size) return size;
+
+  start = get_time_ns();
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    if (mode == COMPRESS_RANGE) {
+      decompressed_size = enet_range_coder_decompress(range_coder, compressed, compressed_size,
+                                                      decompressed, size);
+    }
+    else { decompressed_size = zrle_decompress(NULL, compressed, compressed_size, decompressed, size); }
   }
+  counter->decode_ns[mode] += (get_time_ns() - start) / BENCH_ROUNDS;
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_UNSEQUENCED);
-  enet_host_broadcast(app.server, 0, packet);
+  if (decompressed_size != size || memcmp(decompressed, data, size) != 0) {
+    fprintf(stderr, "%s didn't round trip a packet.\n", compression_names[mode]);
+  }
+  return compressed_size;
+}
 
-  //Cleanup
+void print_bench_counter(const char *name, Bench_counter *counter) {
+  printf("%-26s %8u %10llu", name, counter->packets, (unsigned long long)counter->bytes);
+
+  for (int mode = COMPRESS_RANGE; mode < COMPRESS_COUNT; mode++) {
+    printf("   %6.3f %8.0f %8.0f", (double)counter->compressed[mode] / counter->bytes,
+      (double)counter->encode_ns[mode] / counter->packets,
+      (double)counter->decode_ns[mode] / counter->packets);
+  }
+  printf("\n");
+}
+
+//Compress every payload of a capture & report the trade-off per packet type.
+//ENet compresses whole datagrams, so this is a lower bound on the gain
+int bench_compress(char **argv) {
+  Bench_counter host_counters[HOST_PACKET_COUNT] = {0};
+  Bench_counter client_counters[CLIENT_PACKET_COUNT] = {0};
+  Bench_counter total = {0};
+  uint8_t origin;
+  uint32_t size;
+
+  if (!argv[2]) {
+    fprintf(stderr, "Use the following format:\n"
+                    "%s bench-compress <capture file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *in = fopen(argv[2], "rb");
+  if (!in) {
+    fprintf(stderr, "Failed to open %s.\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  void *range_coder = enet_range_coder_create();
+  uint8_t *data = malloc(CAPTURE_PACKET_MAX);
+  uint8_t *compressed = malloc(CAPTURE_PACKET_MAX);
+  uint8_t *decompressed = malloc(CAPTURE_PACKET_MAX);
+
+  while (fread(&origin, sizeof(uint8_t), 1, in) == 1 &&
+         fread(&size, sizeof(uint32_t), 1, in) == 1) {
+    if (size > CAPTURE_PACKET_MAX) {
+      fprintf(stderr, "%s is corrupt, skipping the rest.\n", argv[2]);
+      break;
+    }
+    if (fread(data, 1, size, in) != size) break; //Cut off capture
+    if (!size) continue;
+
+    Bench_counter *counter = NULL;
+    if (origin == CAPTURE_FROM_HOST && data[0] < HOST_PACKET_COUNT) counter = &host_counters[data[0]];
+    if (origin == CAPTURE_FROM_CLIENT && data[0] < CLIENT_PACKET_COUNT) counter = &client_counters[data[0]];
+    if (!counter) continue;
+
+    counter->packets++;
+    counter->bytes += size;
+    for (int mode = COMPRESS_RANGE; mode < COMPRESS_COUNT; mode++) {
+      counter->compressed[mode] += bench_packet(mode, range_coder, data, size,
+                                                compressed, decompressed, counter);
+    }
+  }
+  fclose(in);
   free(data);
+  free(compressed);
+  free(decompressed);
+  enet_range_coder_destroy(range_coder);
+
+  printf("%-26s %8s %10s   %6s %8s %8s   %6s %8s %8s\n", "Packet", "Count", "Bytes",
+    "range", "enc ns", "dec ns", "zrle", "enc ns", "dec ns");
+
+  for (int i = 0; i < HOST_PACKET_COUNT + CLIENT_PACKET_COUNT; i++) {
+    Bench_counter *counter = i < HOST_PACKET_COUNT ? &host_counters[i]
+                                                   : &client_counters[i - HOST_PACKET_COUNT];
+    if (!counter->packets) continue;
+
+    print_bench_counter(i < HOST_PACKET_COUNT ? host_packet_names[i]
+                                              : client_packet_names[i - HOST_PACKET_COUNT], counter);
+
+    total.packets += counter->packets;
+    total.bytes += counter->bytes;
+    for (int mode = 0; mode < COMPRESS_COUNT; mode++) {
+      total.compressed[mode] += counter->compressed[mode];
+      total.encode_ns[mode] += counter->encode_ns[mode];
+      total.decode_ns[mode] += counter->decode_ns[mode];
+    }
+  }
+
+  if (!total.packets) {
+    fprintf(stderr, "%s has no packets.\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+  print_bench_counter("Total", &total);
+  return 0;
 }
 
-void send_enet_host_new_bullet(Player *player, Bullet *bullet) {
-  /* PACKET STRUCTURE
-  ----------------------------------------------------------------------
-  |  flag  |  p_id  |     pos_x      |     pos_y      |     angle      |
-  ----------------------------------------------------------------------
+/* Enet logic */
+int init_enet() {
+  if (enet_initialize() != 0) {
+    fprintf(stderr, "Failed to initialize Enet.\n");
+    return EXIT_FAILURE;
+  }
+
+  app.enet_initialized = 1;
+  return 0;
+}
+
+int init_server() {
+  enet_address_set_host(&app.address, app.ip_address);
+  app.address.port = app.port ? app.port : HOST_PORT;
+
+  //Let ENet throttle reliable traffic within the same budget as snapshots
+  uint64_t outgoing = (uint64_t)app.peer_budget * MAX_PEERS;
+  if (outgoing > UINT32_MAX) outgoing = UINT32_MAX;
+
+  app.server = enet_host_create(&app.address, MAX_PEERS, CHANNEL_COUNT, 0, outgoing);
+  if (app.server == NULL) {
+    fprintf(stderr, "Failed to initialize an Enet server.\n");
+    return EXIT_FAILURE;
+  }
+  if (set_compression(app.server) == EXIT_FAILURE) return EXIT_FAILURE;
+
+  printf("Enet server successfully initialized.\n");
+  return 0;
+}
+
+int init_client() {
+  enet_address_set_host(&app.address, app.ip_address);
+  uint16_t port = app.relay ? app.upstream_port : app.port; //A relay's own port faces spectators
+  app.address.port = port ? port : HOST_PORT;
+
+  //Spectator fan out of a relay isn't bounded by a single peer's budget
+  uint32_t incoming = app.relay ? 0 : app.peer_budget;
+  app.client = enet_host_create(NULL, 1, CHANNEL_COUNT, incoming, 0);
+  if (app.client == NULL) {
+    fprintf(stderr, "Failed to initialize an Enet client.\n");
+    return EXIT_FAILURE;
+  }
+  if (set_compression(app.client) == EXIT_FAILURE) return EXIT_FAILURE;
+
+  printf("Enet client successfully initialized.\n");
+  return 0;
+}
+
+//Open a relay to spectators once it has a game to show them
+int init_relay_host() {
+  ENetAddress address = { ENET_HOST_ANY, app.port ? app.port : RELAY_PORT };
+
+  app.relay_host = enet_host_create(&address, MAX_PEERS, CHANNEL_COUNT, 0, 0);
+  if (app.relay_host == NULL) {
+    fprintf(stderr, "Failed to initialize an Enet relay.\n");
+    return EXIT_FAILURE;
+  }
+  if (set_compression(app.relay_host) == EXIT_FAILURE) return EXIT_FAILURE;
+
+  printf("Relaying to spectators on port %u.\n", address.port);
+  return 0;
+}
+
+void host_send_welcome(ENetPeer *peer) {
+  /* PACKET STRUCTURE */
+  /*
+  ----------------------------------------------------------------
+  |  flag  |  p_id  | t_rate |    full_state    |   map_image    |
+  ----------------------------------------------------------------
   */
+  uint8_t *id = (uint8_t *)peer->data;
 
-  // Create memory block containing all bullet information
-  int sizeof_data = 2 * sizeof(uint8_t) + 3 * sizeof(uint16_t);
+  // Create memory block containing everything needed to start playing
+  int sizeof_data = 3 * sizeof(uint8_t) + full_state_size() + app.map.image_size;
   uint8_t *data = malloc(sizeof_data);
-  uint8_t data_index = 1;
-  ENetPacket *packet;
 
-  data[0] = HOST_NEW_BULLET_PACKET;
-  memcpy(&data[data_index], &player->id, sizeof(uint8_t));
-  data_index += 1;
+  data[0] = HOST_WELCOME_PACKET;
+  data[1] = id ? *id : SPECTATOR_ID;
+  data[2] = app.tick_rate; //Every input packet is one step, so clients tick alike
+  int position_index = 3;
 
-  uint16_t pos_x = bullet->pos_x;
-  uint16_t pos_y = bullet->pos_y;
-  int16_t angle = bullet->angle;
+  position_index += write_full_state(&data[position_index]);
+  memcpy(&data[position_index], app.map.image, app.map.image_size);
 
-  memcpy(&data[data_index], &pos_x, sizeof(uint16_t));
-  data_index += 2;
-  memcpy(&data[data_index], &pos_y, sizeof(uint16_t));
-  data_index += 2;
-  memcpy(&data[data_index], &angle, sizeof(int16_t));
+  net_peer_send(peer, data, sizeof_data);
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_UNSEQUENCED);
-  enet_host_broadcast(app.server, 0, packet);
-
-  //Cleanup
+  // Cleanup
   free(data);
 }
 
-void send_enet_host_player_hit(Player *p_hit, Player *p_shooter) {
-  /* PACKET STRUCTURE
-  ----------------------------
-  |  flag  |p_hit_id|p_sht_id|
-  ----------------------------
+void host_send_full_state(ENetPeer *peer) {
+  /* PACKET STRUCTURE */
+  /*
+  -----------------------------
+  |  flag  |    full_state    |
+  -----------------------------
   */
 
-  // Create memory block containing id of player that was hit and the shooter
-  int sizeof_data = 3 * sizeof(uint8_t);
+  // Create memory block containing the complete game state
+  int sizeof_data = sizeof(uint8_t) + full_state_size();
   uint8_t *data = malloc(sizeof_data);
-  ENetPacket *packet;
 
-  data[0] = HOST_PLAYER_HIT_PACKET;
-  data[1] = p_hit->id;
-  data[2] = p_shooter->id;
+  data[0] = HOST_FULL_STATE_PACKET;
+  write_full_state(&data[1]);
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_UNSEQUENCED);
-  enet_host_broadcast(app.server, 0, packet);
+  net_peer_send(peer, data, sizeof_data);
 
-  //Cleanup
+  //The block covers every event so far
+  app.peers[peer->incomingPeerID].event_ack = app.event_seq;
+
+  // Cleanup
   free(data);
 }
 
-void send_enet_client_state() {
+void host_send_player_joined() {
   /* PACKET STRUCTURE
-  ----------------------------------------------------------------
-  |  flag  |   up   |  down  |  left  | right  | but_a  | but_b  |
-  ----------------------------------------------------------------
+  -----------------------------------------------------
+  |  flag  |  p_id  |     pos_x      |     pos_y      |
+  -----------------------------------------------------
+  */
+  Player *player = &app.players[app.num_of_players - 1];
+  Player_joined_message message = {
+    player->id, FIXED_TO_INT(player->pos_x), FIXED_TO_INT(player->pos_y)
+  };
+  uint8_t data[PLAYER_JOINED_SIZE];
+
+  encode_player_joined(data, &message);
+  net_host_broadcast(app.server, data, sizeof(data));
+  record_packet(data, sizeof(data));
+}
+
+void host_send_player_left(uint8_t *id) {
+  /* PACKET STRUCTURE
+  -------------------
+  |  flag  |  p_id  |
+  -------------------
   */
+  Player_left_message message = { *id };
+  uint8_t data[PLAYER_LEFT_SIZE];
+
+  encode_player_left(data, &message);
+  net_host_broadcast(app.server, data, sizeof(data));
+  record_packet(data, sizeof(data));
+}
+
+void update_window_title() {
+  if (!app.window) return;
+  char title[64] = "Tanks";
+
+  if (app.client && app.connection_state == CONNECTION_CONNECTING) {
+    snprintf(title, sizeof(title), "Tanks - Connecting to %s (%u/%u)",
+      app.ip_address, app.connect_attempts + 1, CONNECT_ATTEMPTS);
+  }
+  else if (app.client && app.connection_state == CONNECTION_JOINING) {
+    snprintf(title, sizeof(title), "Tanks - Joining %s", app.ip_address);
+  }
+
+  SDL_SetWindowTitle(app.window, title);
+}
+
+//Start a connection attempt, it's driven to completion from the main loop
+int connect_to_host() {
+  uint32_t connect_data = app.spectate ? CONNECT_SPECTATOR : 0;
+  if (app.relay) connect_data |= CONNECT_RELAY;
+  connect_data |= app.compress << CONNECT_COMPRESSION_SHIFT;
+  app.peer = enet_host_connect(app.client, &app.address, CHANNEL_COUNT, connect_data);
+
+  if (app.peer == NULL) {
+    fprintf(stderr, "Peer not found.\n");
+    return EXIT_FAILURE;
+  }
+
+  //Back off exponentially between attempts
+  uint64_t timeout = (uint64_t)CONNECT_TIMEOUT << app.connect_attempts;
+  app.connection_state = CONNECTION_CONNECTING;
+  app.connect_deadline = get_time_ns() + timeout * 1000000;
+  enet_host_flush(app.client); //Don't wait for the first tick
+
+  printf("Connecting to host (attempt %u/%u).\n", app.connect_attempts + 1, CONNECT_ATTEMPTS);
+  update_window_title();
+  return 0;
+}
+
+void retry_connection() {
+  if (app.peer) {
+    netem_drop_peer(&app.netem_out, app.peer);
+    netem_drop_peer(&app.netem_in, app.peer);
+
+    //Once connected the host made us a player, tell it to let go of it
+    if (app.connection_state == CONNECTION_CONNECTING) { enet_peer_reset(app.peer); }
+    else { enet_peer_disconnect_now(app.peer, 0); }
+  }
+  app.peer = NULL;
+
+  if (++app.connect_attempts >= CONNECT_ATTEMPTS) {
+    fprintf(stderr, "Failed to connect to host.\n");
+    //A host compressing differently may drop the connect before it can refuse it
+    if (app.compress) fprintf(stderr, "Check that it uses %s compression too.\n",
+                              compression_names[app.compress]);
+    exit(EXIT_FAILURE);
+  }
+  if (connect_to_host() == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+}
+
+//Forget everything the host told us, a new welcome brings it back
+void reset_session() {
+  app.num_of_players = 0;
+  app.local_player = NULL;
+  grid_rebuild();
+  unload_map();
+}
+
+void update_connection() {
+  if (!app.client || app.connection_state == CONNECTION_CONNECTED) return;
+  if (get_time_ns() >= app.connect_deadline) retry_connection();
+}
+
+//Conditions are given as latency=ms,jitter=ms,loss=0-1,rate=B/s
+int parse_netem(Netem *netem, char *spec) {
+  char *key = strtok(spec, ",");
+
+  while (key) {
+    char *value = strchr(key, '=');
+    if (!value) {
+      fprintf(stderr, "Network conditions are key=value pairs, got %s.\n", key);
+      return EXIT_FAILURE;
+    }
+    *value++ = '\0';
+
+    if (strcmp(key, "latency") == 0) { netem->latency = strtoul(value, NULL, 10); }
+    else if (strcmp(key, "jitter") == 0) { netem->jitter = strtoul(value, NULL, 10); }
+    else if (strcmp(key, "loss") == 0) { netem->loss = strtof(value, NULL); }
+    else if (strcmp(key, "rate") == 0) { netem->rate = strtoul(value, NULL, 10); }
+    else {
+      fprintf(stderr, "Unknown network condition %s.\n", key);
+      return EXIT_FAILURE;
+    }
+    key = strtok(NULL, ",");
+  }
+
+  if (netem->loss < 0 || netem->loss > 1) {
+    fprintf(stderr, "Loss is a chance between 0 and 1.\n");
+    return EXIT_FAILURE;
+  }
+
+  netem->enabled = 1;
+  return 0;
+}
+
+int parse_options(int argc, char **argv) {
+  int positional = 1;
+
+  //Strip options from argv so only positional arguments remain
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.stats_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--headless") == 0) { app.headless = 1; }
+    else if (strcmp(argv[i], "--map") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.map_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--vsync") == 0) { app.vsync = 1; }
+    else if (strcmp(argv[i], "--spectate") == 0) { app.spectate = 1; }
+    else if (strcmp(argv[i], "--port") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.port = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--delay") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.relay_delay = strtoul(argv[++i], NULL, 10);
+      if (app.relay_delay > RELAY_DELAY_MAX) {
+        fprintf(stderr, "Relay delay can be at most %d ms.\n", RELAY_DELAY_MAX);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strcmp(argv[i], "--fps") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.fps_cap = atoi(argv[++i]);
+      if (app.fps_cap < 0) {
+        fprintf(stderr, "Frame rate cap can't be negative.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strcmp(argv[i], "--tick-rate") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      int tick_rate = atoi(argv[++i]);
+      if (tick_rate < TICK_RATE_MIN || tick_rate > TICK_RATE_MAX) {
+        fprintf(stderr, "Tick rate must be between %d and %d.\n", TICK_RATE_MIN, TICK_RATE_MAX);
+        return EXIT_FAILURE;
+      }
+      app.tick_rate = tick_rate;
+    }
+    else if (strcmp(argv[i], "--netem-out") == 0 || strcmp(argv[i], "--netem-in") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      Netem *netem = strcmp(argv[i], "--netem-out") == 0 ? &app.netem_out : &app.netem_in;
+      if (parse_netem(netem, argv[++i]) == EXIT_FAILURE) return EXIT_FAILURE;
+    }
+    else if (strcmp(argv[i], "--compress") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      int mode = parse_compression(argv[++i]);
+      if (mode < 0) return EXIT_FAILURE;
+      app.compress = mode;
+    }
+    else if (strcmp(argv[i], "--capture") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.capture_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--record") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.record_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--seek") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.replay.seek = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--speed") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.speed = strtof(argv[++i], NULL);
+      if (app.speed < 0) {
+        fprintf(stderr, "Playback speed can't be negative.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strcmp(argv[i], "--peer-budget") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.peer_budget = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--rewind-cap") == 0) {
+      if (!argv[i + 1]) {
+        fprintf(stderr, "Missing value for %s.\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      app.rewind_cap = strtoul(argv[++i], NULL, 10);
+      if (app.rewind_cap > REWIND_CAP_MAX) {
+        fprintf(stderr, "Rewind cap can be at most %d ms.\n", REWIND_CAP_MAX);
+        return EXIT_FAILURE;
+      }
+    }
+    else { argv[positional++] = argv[i]; }
+  }
+
+  argv[positional] = NULL;
+  return 0;
+}
+
+int host_or_join(char **argv) {
+  char *err_msg = "Use the following format:\n"
+                  "%s < host <local | online <ip> > | join [ip] | relay <ip[:port]> > [options]\n"
+                  "%s compile-map <text file> <map file>\n"
+                  "%s bench-compress <capture file>\n"
+                  "%s play <recording> [--seek <tick>] [--speed <x>] [--headless]\n"
+                  "Options:\n"
+                  "  --port <n>          Port to host, join or relay on\n"
+                  "  --spectate          Join without a player\n"
+                  "  --delay <ms>        Hold a relay's stream back before fanning it out\n"
+                  "  --stats <file | ->  Write network telemetry as JSON lines\n"
+                  "  --compress <none | range | zrle>\n"
+                  "                      Compress datagrams, host & clients must match\n"
+                  "  --capture <file>    Record packet payloads for bench-compress\n"
+                  "  --record <file>     Record the match of a host for play\n"
+                  "  --seek <tick>       Start playing a recording from a tick\n"
+                  "  --speed <x>         Playback speed, 0 plays as fast as possible\n"
+                  "  --headless          Host a dedicated server without a window\n"
+                  "  --map <file>        Host a compiled map instead of the default\n"
+                  "  --vsync             Synchronize frames with the display\n"
+                  "  --fps <n>           Cap the frame rate, 0 benchmarks uncapped\n"
+                  "  --tick-rate <n>     Simulation ticks per second of a host (default %d)\n"
+                  "  --rewind-cap <ms>   Limit host lag compensation (default %d)\n"
+                  "  --peer-budget <B/s> Bandwidth per peer, 0 is unlimited (default %d)\n"
+                  "  --netem-out <conditions>\n"
+                  "  --netem-in <conditions>\n"
+                  "                      Emulate a network on sent or received packets, as\n"
+                  "                      latency=ms,jitter=ms,loss=0-1,rate=B/s\n";
+  if (!argv[1]) {
+    fprintf(stderr, err_msg, argv[0], argv[0], argv[0], argv[0], TICK_RATE, REWIND_CAP, PEER_BUDGET);
+    return EXIT_FAILURE;
+  }
+
+  //Only a replay can leave real time
+  if (strcmp(argv[1], "play") != 0 && (app.speed != 1 || app.replay.seek)) {
+    fprintf(stderr, "Only play can seek or change speed.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(argv[1], "host") == 0) {
+    if (!argv[2]) { app.ip_address = "127.0.0.1"; }
+    else if (strcmp(argv[2], "local") == 0) { app.ip_address = "127.0.0.1"; }
+    else if (strcmp(argv[2], "online") == 0) {
+      if (!argv[3]) {
+        fprintf(stderr, err_msg, argv[0], argv[0], argv[0], argv[0], TICK_RATE, REWIND_CAP, PEER_BUDGET);
+        return EXIT_FAILURE;
+      }
+      app.ip_address = argv[3];
+    }
+    else {
+      fprintf(stderr, err_msg, argv[0], argv[0], argv[0], argv[0], TICK_RATE, REWIND_CAP, PEER_BUDGET);
+      return EXIT_FAILURE;
+    }
+    return init_server();
+  }
+  else if (strcmp(argv[1], "join") == 0) {
+    if (app.headless) {
+      fprintf(stderr, "Only a host can run headless.\n");
+      return EXIT_FAILURE;
+    }
+
+    if (!argv[2]) { app.ip_address = "127.0.0.1"; }
+    else { app.ip_address = argv[2]; }
+
+    if (init_client() == EXIT_FAILURE) { return EXIT_FAILURE; }
+    return connect_to_host();
+  }
+  else if (strcmp(argv[1], "relay") == 0) {
+    if (!argv[2]) {
+      fprintf(stderr, err_msg, argv[0], argv[0], argv[0], argv[0], TICK_RATE, REWIND_CAP, PEER_BUDGET);
+      return EXIT_FAILURE;
+    }
+    app.ip_address = argv[2];
+    app.spectate = 1; //Relays only watch
+
+    char *upstream_port = strchr(argv[2], ':');
+    if (upstream_port) {
+      *upstream_port++ = '\0';
+      app.upstream_port = atoi(upstream_port);
+    }
+
+    if (init_client() == EXIT_FAILURE) { return EXIT_FAILURE; }
+    return connect_to_host();
+  }
+  else if (strcmp(argv[1], "play") == 0) {
+    if (!argv[2]) {
+      fprintf(stderr, err_msg, argv[0], argv[0], argv[0], argv[0], TICK_RATE, REWIND_CAP, PEER_BUDGET);
+      return EXIT_FAILURE;
+    }
+    return init_replay(argv[2]);
+  }
+  else {
+    fprintf(stderr, err_msg, argv[0], argv[0], argv[0], argv[0], TICK_RATE, REWIND_CAP, PEER_BUDGET);
+    return EXIT_FAILURE;
+  }
+}
+
+/* Dispatch logic */
+const Packet_dispatch host_packet_dispatch[HOST_PACKET_COUNT] = {
+  HOST_PACKETS(PACKET_DISPATCH)
+};
+
+const Packet_dispatch client_packet_dispatch[CLIENT_PACKET_COUNT] = {
+  CLIENT_PACKETS(PACKET_DISPATCH)
+};
+
+//Check a received packet against the schema, NULL if it's malformed
+const Packet_dispatch *validate_packet(const Packet_dispatch *dispatch,
+                                       int num_of_types, uint8_t *data, size_t size) {
+  if (size == 0 || data[0] >= num_of_types || size < dispatch[data[0]].min_size) {
+    app.stats.malformed++;
+    return NULL;
+  }
+
+  return &dispatch[data[0]];
+}
+
+void reset_peer_state(Peer_state *peer_state) {
+  memset(peer_state, 0, sizeof(Peer_state));
+  peer_state->event_ack = app.event_seq; //Events from before joining are not sent
+  peer_state->min_rtt = UINT32_MAX;
+  peer_state->snapshot_interval = 1;
+  memset(peer_state->staleness, UINT8_MAX, sizeof(peer_state->staleness));
+}
+
+void handle_host_event_connect() {
+  reset_peer_state(&app.peers[app.event.peer->incomingPeerID]);
+  app.peers[app.event.peer->incomingPeerID].relay = (app.event.data & CONNECT_RELAY) != 0;
+  app.event.peer->data = NULL;
+
+  //A different compressor would turn every datagram into garbage, refuse it if the
+  //connect made it through. One that compressed it differently never gets here
+  if (app.event.data >> CONNECT_COMPRESSION_SHIFT != app.compress) {
+    printf("Refused %x:%u, it doesn't use %s compression.\n",
+      app.event.peer->address.host, app.event.peer->address.port,
+      compression_names[app.compress]);
+    enet_peer_disconnect(app.event.peer, DISCONNECT_COMPRESSION);
+    return;
+  }
+
+  if (app.overload >= OVERLOAD_REFUSE_JOINS) {
+    printf("Refused %x:%u, the host is overloaded.\n",
+      app.event.peer->address.host, app.event.peer->address.port);
+    enet_peer_disconnect(app.event.peer, DISCONNECT_OVERLOADED);
+    return;
+  }
+
+  //Spectators get the game without a player, relays only have spectators
+  if (app.event.data & CONNECT_SPECTATOR || app.relay) {
+    printf("New spectator connected from %x:%u.\n",
+      app.event.peer->address.host, app.event.peer->address.port);
+
+    app.event.peer->data = NULL;
+    host_send_welcome(app.event.peer);
+    return;
+  }
+
+  uint8_t id = free_player_id();
+  if (id == SPECTATOR_ID) {
+    printf("Refused %x:%u, there is no free player id.\n",
+      app.event.peer->address.host, app.event.peer->address.port);
+    enet_peer_disconnect(app.event.peer, DISCONNECT_FULL);
+    return;
+  }
+
+  printf("New client connected from %x:%u.\n",
+    app.event.peer->address.host, app.event.peer->address.port);
+
+  //Assign ID to client CHECK IF DATA GETS FREED AFTER PEER DISCONNECTS!!
+  //ASK ON IRC?
+  app.event.peer->data = malloc(sizeof(uint8_t));
+  memcpy(app.event.peer->data, &id, sizeof(uint8_t));
+
+  //Create player
+  Player *player = &app.players[app.num_of_players];
+  uint16_t pos_x, pos_y;
+  pick_start_position(&pos_x, &pos_y);
+  uint8_t res = create_player(player, id, pos_x, pos_y);
+  if (res == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+
+  host_send_welcome(app.event.peer); //Send players, bullets & map to client
+  host_send_player_joined(); //Broadcast player joined to all
+}
+
+void handle_host_packet_state(uint8_t *data, size_t size) {
+  Client_state_message message;
+  decode_client_state(data, &message);
+
+  uint8_t *player_ID = (uint8_t *)app.event.peer->data;
+  Player *player = player_ID ? get_player_by_id(*player_ID) : NULL;
+
+  //Spectators only acknowledge events
+  if (player) {
+    if (message.up) { movePlayerForward(player); };
+    if (message.down) { movePlayerBackward(player); };
+    if (message.left) { turnPlayer(player, -1); };
+    if (message.right) { turnPlayer(player, 1); };
+    if (message.button_a && !player->button_a_is_down) {
+      shoot_bullet(player);
+      player->button_a_is_down = 1;
+    };
+    if (!message.button_a && player->button_a_is_down) { player->button_a_is_down = 0; };
+  }
+
+  ack_events(&app.peers[app.event.peer->incomingPeerID], message.event_ack);
+}
+
+void handle_host_packet_resync(uint8_t *data, size_t size) {
+  printf("Client %x:%u asked for a resync.\n",
+    app.event.peer->address.host, app.event.peer->address.port);
+  host_send_full_state(app.event.peer);
+}
+
+void handle_host_event_receive() {
+  uint8_t *data = app.event.packet->data;
+  size_t size = app.event.packet->dataLength;
+
+  const Packet_dispatch *dispatch = validate_packet(client_packet_dispatch,
+                                                    CLIENT_PACKET_COUNT, data, size);
+  if (dispatch) dispatch->handler(data, size);
+}
+
+void handle_host_event_disconnect() {
+  netem_drop_peer(&app.netem_out, app.event.peer);
+  netem_drop_peer(&app.netem_in, app.event.peer);
+
+  if (!app.event.peer->data) {
+    printf("Spectator disconnected from %x:%u.\n",
+      app.event.peer->address.host, app.event.peer->address.port);
+    return;
+  }
+
+  printf("Client disconnected from %x:%u.\n",
+    app.event.peer->address.host, app.event.peer->address.port);
+
+  host_send_player_left(app.event.peer->data);
+  uint8_t res = delete_player(app.event.peer->data);
+  if ( res == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+}
+
+void poll_enet_host(ENetHost *host) {
+  while (enet_host_service(host, &app.event, 0) > 0) {
+    switch (app.event.type) {
+      case ENET_EVENT_TYPE_CONNECT:
+        handle_host_event_connect();
+        break;
+      case ENET_EVENT_TYPE_RECEIVE:
+        net_receive(app.event.peer, app.event.channelID, app.event.packet);
+        break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+        handle_host_event_disconnect();
+        break;
+      case ENET_EVENT_TYPE_NONE:
+        break;
+    }
+  }
+}
+
+//Malformed session messages are dropped, the welcome timeout or a resync retries
+int apply_welcome(uint8_t *data, size_t size) {
+  int data_index = 3;
+  if (size < (size_t)data_index || data[2] < TICK_RATE_MIN || data[2] > TICK_RATE_MAX ||
+      check_full_state(&data[data_index], size - data_index) < 0) {
+    fprintf(stderr, "Received an invalid welcome from the host.\n");
+    app.stats.malformed++;
+    return EXIT_FAILURE;
+  }
+
+  uint8_t local_id = data[1];
+  app.tick_rate = data[2];
+  reset_session();
+  data_index += apply_full_state(&data[data_index], size - data_index);
+
+  if (local_id != SPECTATOR_ID) app.local_player = get_player_by_id(local_id);
+  if (local_id != SPECTATOR_ID && !app.local_player) {
+    fprintf(stderr, "Received an invalid welcome from the host.\n");
+    app.stats.malformed++;
+    reset_session();
+    return EXIT_FAILURE;
+  }
+
+  //Copy map file, the packet is gone after this event
+  uint8_t *buffer = malloc(size - data_index);
+  memcpy(buffer, &data[data_index], size - data_index);
+
+  if (load_map_image(buffer, size - data_index) == EXIT_FAILURE) {
+    free(buffer);
+    fprintf(stderr, "Received an invalid map from the host.\n");
+    app.stats.malformed++;
+    reset_session();
+    return EXIT_FAILURE;
+  }
+  app.map.buffer = buffer;
+
+  app.connection_state = CONNECTION_CONNECTED;
+  app.connect_attempts = 0;
+  update_window_title();
+
+  if (local_id == SPECTATOR_ID) {
+    printf("Spectating.\n");
+    return 0;
+  }
+  printf("Your id is: %d\n", app.local_player->id);
+  return 0;
+}
+
+void handle_client_packet_welcome(uint8_t *data, size_t size) {
+  apply_welcome(data, size);
+}
+
+void handle_client_packet_full_state(uint8_t *data, size_t size) {
+  uint8_t local_id = app.local_player ? app.local_player->id : SPECTATOR_ID;
+
+  if (apply_full_state(&data[1], size - 1) < 0) {
+    fprintf(stderr, "Received an invalid full state from the host.\n");
+    app.stats.malformed++;
+    return;
+  }
+
+  //Watch without a player until the next full state brings ours back
+  if (local_id != SPECTATOR_ID) app.local_player = get_player_by_id(local_id);
+  if (local_id != SPECTATOR_ID && !app.local_player) {
+    fprintf(stderr, "Received an invalid full state from the host.\n");
+    app.stats.malformed++;
+    return;
+  }
+
+  printf("Resynchronized with the host.\n");
+}
+
+void send_enet_client_resync() {
+  /* PACKET STRUCTURE
+  ----------
+  |  flag  |
+  ----------
+  */
+  uint8_t data = CLIENT_RESYNC_PACKET;
+
+  net_peer_send(app.peer, &data, sizeof(data));
+  app.resync_pending = 1;
+}
+
+void handle_client_packet_state(uint8_t *data, size_t size) {
+  Bit_reader reader = { &data[1], size - 1 };
+  uint8_t count = read_bits(&reader, 8);
+  uint8_t partial = read_bits(&reader, 1);
+  uint8_t matched = 0;
+  uint64_t now = get_time_ns();
+  uint64_t longest = 2 * SNAPSHOT_INTERVAL_MAX * tick_length();
+
+  for (uint8_t i = 0; i < count; i++) {
+    //Update player positions by id
+    uint8_t id = read_quantized(&reader, &QUANT_ID);
+    fixed pos_x = FLOAT_TO_FIXED(read_quantized(&reader, &app.quant_x));
+    fixed pos_y = FLOAT_TO_FIXED(read_quantized(&reader, &app.quant_y));
+    int16_t angle = read_angle(&reader);
+    if (reader.overflow) return;
+
+    Player *player = get_player_by_id(id);
+    if (!player) continue; //Joined packet still on its way, or a desync
+
+    //Remote tanks are drawn an interval late, blending from the previous snapshot
+    if (player != app.local_player) {
+      uint64_t gap = now - player->snapshot_time;
+      if (gap < tick_length()) gap = tick_length(); //Snapshots bunched up by jitter
+
+      //Go on from where the tank is drawn, a snapshot arriving early mustn't pull it back
+      if (player->snapshot_interval) { blend_previous_snapshot(player); }
+      else {
+        player->prev_pos_x = player->pos_x;
+        player->prev_pos_y = player->pos_y;
+        player->prev_angle = player->angle;
+      }
+
+      //The first snapshot, or one after a pause, just jumps there. The host changes
+      //the rate by whole ticks, follow a change at once & smooth out the jitter
+      int64_t change = (int64_t)gap - (int64_t)player->snapshot_interval;
+      if (!player->snapshot_time || gap > longest) { player->snapshot_interval = 0; }
+      else if (!player->snapshot_interval || llabs(change) > (int64_t)tick_length()) {
+        player->snapshot_interval = gap;
+      }
+      else { player->snapshot_interval = (player->snapshot_interval * 3 + gap) / 4; }
+      player->snapshot_time = now;
+    }
+
+    player->pos_x = pos_x;
+    player->pos_y = pos_y;
+    player->angle = INT_TO_FIXED(angle);
+    grid_update_player(player);
+    matched++;
+  }
+
+  //Joins & leaves race snapshots for a moment, only a lasting mismatch is a desync
+  if (matched == count && (partial || count == app.num_of_players)) {
+    app.snapshot_mismatches = 0;
+  }
+  else if (++app.snapshot_mismatches >= RESYNC_AFTER && !app.resync_pending && app.peer) {
+    send_enet_client_resync(); //Replays have no host to ask, their next keyframe resyncs
+  }
+}
+
+void handle_client_packet_player_joined(uint8_t *data, size_t size) {
+  Player_joined_message message;
+  decode_player_joined(data, &message);
+
+  //When a new player joins they receive a HOST_WELCOME_PACKET
+  //packet privately & HOST_PLAYER_JOINED_PACKET packet via broadcast
+  //so they need to ignore the HOST_PLAYER_JOINED_PACKET
+  if (get_player_by_id(message.id)) return;
+  if (message.id == SPECTATOR_ID || app.num_of_players == MAX_PLAYERS) {
+    app.stats.malformed++;
+    return;
+  }
+
+  Player *player = &app.players[app.num_of_players];
+  uint8_t res = create_player(player, message.id, message.pos_x, message.pos_y);
+  if (res == EXIT_FAILURE) { app.stats.malformed++; }
+}
+
+void handle_client_packet_player_left(uint8_t *data, size_t size) {
+  Player_left_message message;
+  decode_player_left(data, &message);
+
+  if (delete_player(&message.id) == EXIT_FAILURE) { app.stats.malformed++; }
+}
+
+void handle_client_event_player_hit(Game_event *event) {
+  printf("Player %d was shot by player %d\n", event->hit_id, event->player_id);
+}
+
+void handle_client_event_new_bullet(Game_event *event) {
+  //Ignore if own bullet
+  if (app.local_player && event->player_id == app.local_player->id) return;
+  Player *player = get_player_by_id(event->player_id);
+  if (!player) return;
+
+  spawn_bullet(player, event->pos_x, event->pos_y, event->angle);
+}
+
+void handle_client_packet_events(uint8_t *data, size_t size) {
+  Bit_reader reader = { &data[1], size - 1 };
+  uint16_t seq = read_bits(&reader, 16);
+  uint8_t count = read_bits(&reader, 8);
+
+  for (uint8_t i = 0; i < count; i++, seq++) {
+    Game_event event;
+    read_event(&reader, &event);
+    if (reader.overflow) return;
+
+    //Events are repeated until acknowledged, skip the ones already applied
+    if ((int16_t)(seq - app.event_ack) <= 0) continue;
+
+    if (event.type == EVENT_NEW_BULLET) handle_client_event_new_bullet(&event);
+    else if (event.type == EVENT_PLAYER_HIT) handle_client_event_player_hit(&event);
+    app.event_ack = seq;
+  }
+}
+
+void handle_client_event_receive() {
+  uint8_t *data = app.event.packet->data;
+  size_t size = app.event.packet->dataLength;
+
+  const Packet_dispatch *dispatch = validate_packet(host_packet_dispatch,
+                                                    HOST_PACKET_COUNT, data, size);
+  if (!dispatch) return;
+
+  if (app.relay) { relay_receive(data, size); return; } //Applied after the delay
+
+  //Not playing until welcomed
+  if (data[0] != HOST_WELCOME_PACKET && app.connection_state != CONNECTION_CONNECTED) return;
+  dispatch->handler(data, size);
+}
+
+void poll_enet_client() {
+  while (enet_host_service(app.client, &app.event, 0) > 0) {
+    switch (app.event.type) {
+      case ENET_EVENT_TYPE_CONNECT:
+        printf("Successfully connected to host.\n");
+        app.connection_state = CONNECTION_JOINING;
+        app.connect_deadline = get_time_ns() + (uint64_t)WELCOME_TIMEOUT * 1000000;
+        update_window_title();
+        break;
+      case ENET_EVENT_TYPE_RECEIVE:
+        net_receive(app.event.peer, app.event.channelID, app.event.packet);
+        break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+        netem_drop_peer(&app.netem_out, app.event.peer);
+        netem_drop_peer(&app.netem_in, app.event.peer);
+        app.peer = NULL; //ENet already reset it
+        if (app.event.data == DISCONNECT_COMPRESSION) {
+          fprintf(stderr, "The host uses a different compression, see --compress.\n");
+          exit(EXIT_FAILURE);
+        }
+        if (app.event.data == DISCONNECT_OVERLOADED) printf("The host is overloaded.\n");
+        if (app.event.data == DISCONNECT_FULL) printf("The host is full.\n");
+        if (app.connection_state != CONNECTION_CONNECTED) {
+          retry_connection();
+          break;
+        }
+
+        //Lost an established session, join again from scratch
+        printf("Disconnected from host.\n");
+        reset_session();
+        relay_clear();
+        app.connect_attempts = 0;
+        if (connect_to_host() == EXIT_FAILURE) { exit(EXIT_FAILURE); }
+        break;
+      case ENET_EVENT_TYPE_NONE:
+        break;
+    }
+  }
+}
+
+//Handle a received packet & release it
+void net_deliver(ENetPeer *peer, uint8_t channel, ENetPacket *packet) {
+  app.event.type = ENET_EVENT_TYPE_RECEIVE;
+  app.event.peer = peer;
+  app.event.channelID = channel;
+  app.event.packet = packet;
+
+  stats_count_received(peer, packet);
+  capture_packet(peer->host == app.client ? CAPTURE_FROM_HOST : CAPTURE_FROM_CLIENT,
+                 packet->data, packet->dataLength);
+  if (peer->host == app.client) { handle_client_event_receive(); }
+  else { handle_host_event_receive(); }
+  enet_packet_destroy(packet);
+}
+
+void net_receive(ENetPeer *peer, uint8_t channel, ENetPacket *packet) {
+  if (app.netem_in.enabled) { netem_enqueue(&app.netem_in, peer, channel, packet); }
+  else { net_deliver(peer, channel, packet); }
+}
+
+void poll_enet() {
+  if (app.server) { poll_enet_host(app.server); }
+  else if (app.client) { poll_enet_client(); }
+
+  netem_release_due(&app.netem_in);
+  netem_release_due(&app.netem_out);
+
+  if (app.relay) relay_release_due();
+  if (app.relay_host) poll_enet_host(app.relay_host);
+}
+
+//Pick a snapshot rate from how the link to the peer is doing
+void schedule_peer(ENetPeer *peer) {
+  Peer_state *peer_state = &app.peers[peer->incomingPeerID];
+
+  //Refill the budget, at most a quarter second of it can pile up
+  if (app.peer_budget) {
+    peer_state->budget += (float)app.peer_budget / app.tick_rate;
+    if (peer_state->budget > app.peer_budget / 4) peer_state->budget = app.peer_budget / 4;
+  }
+
+  if (peer->roundTripTime < peer_state->min_rtt) peer_state->min_rtt = peer->roundTripTime;
+  if (++peer_state->ticks_since_schedule < SCHEDULE_PERIOD) return;
+
+  //Loss, queues building up (RTT over the floor) or a budget that can't fit
+  //every entity all mean the peer gets fewer, fuller snapshots
+  float loss = (float)peer->packetLoss / ENET_PEER_PACKET_LOSS_SCALE;
+  uint8_t congested = loss > CONGESTION_LOSS || peer_state->over_budget ||
+                      peer->roundTripTime > peer_state->min_rtt + CONGESTION_RTT;
+  uint8_t *interval = &peer_state->snapshot_interval;
+
+  //Only speed up when the faster rate would still fit the budget
+  peer_state->throughput = peer_state->sent_bytes * app.tick_rate / SCHEDULE_PERIOD;
+  uint8_t headroom = !app.peer_budget || peer_state->relay || *interval == 1 ||
+    (uint64_t)peer_state->throughput * *interval / (*interval - 1) <= app.peer_budget;
+
+  if (peer_state->relay) { *interval = 1; } //A whole audience watches through it
+  else if (congested) { *interval = *interval * 2; }
+  else if (*interval > 1 && headroom) { (*interval)--; }
+  if (*interval > SNAPSHOT_INTERVAL_MAX) *interval = SNAPSHOT_INTERVAL_MAX;
+
+  peer_state->sent_bytes = 0;
+  peer_state->ticks_since_schedule = 0;
+  peer_state->over_budget = 0;
+  peer_state->min_rtt++; //Slowly forget the floor, routes change
+}
+
+//Quantized position & angle of a player as sent in snapshots
+uint64_t snapshot_state(Player *player) {
+  uint64_t state = quantize(&app.quant_x, FIXED_TO_FLOAT(player->pos_x));
+  state |= (uint64_t)quantize(&app.quant_y, FIXED_TO_FLOAT(player->pos_y)) << app.quant_x.bits;
+  uint64_t angle = quantize(&QUANT_ANGLE, ((FIXED_ROUND(player->angle) % 360) + 360) % 360);
+  state |= angle << (app.quant_x.bits + app.quant_y.bits);
+
+  return state;
+}
+
+void send_enet_host_state(ENetPeer *peer) {
+  /* PACKET STRUCTURE */
+  /*                                 |-----------------*number of players------------------|
+  ---------------------------------------------------------------------------------------------
+  |  flag  | num_p (8b) | partial (1b) | p_id (8b) | pos_x (xb) | pos_y (yb) | angle (9b) |
+  ---------------------------------------------------------------------------------------------
+  Positions take as many bits as the map needs, 11 each for the default one
+  */
+  Peer_state *peer_state = &app.peers[peer->incomingPeerID];
+  Player *viewer = peer->data ? get_player_by_id(*(uint8_t *)peer->data) : NULL;
+  uint8_t candidates[MAX_PLAYERS];
+  uint32_t priorities[MAX_PLAYERS];
+  uint8_t num_of_candidates = 0;
+
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    uint8_t *staleness = &peer_state->staleness[app.players[i].id];
+    if (*staleness < UINT8_MAX) (*staleness)++;
+  }
+
+  uint8_t interval = peer_state->snapshot_interval;
+  if (app.overload >= OVERLOAD_SNAPSHOT_RATE) interval *= 2;
+
+  if (peer_state->ticks_since_snapshot < UINT8_MAX) peer_state->ticks_since_snapshot++;
+  if (peer_state->ticks_since_snapshot < interval) return;
+
+  //Rank the entities that changed or went stale, nearby & older ones first
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    Player *player = &app.players[i];
+    uint8_t staleness = peer_state->staleness[player->id];
+    uint8_t changed = snapshot_state(player) != peer_state->last_sent[player->id];
+    if (!changed && staleness < SNAPSHOT_REFRESH) continue;
+
+    uint32_t distance = 0;
+    if (viewer) {
+      distance = abs(player->pos_x - viewer->pos_x) + abs(player->pos_y - viewer->pos_y);
+      distance >>= FIXED_SHIFT;
+    }
+    if (app.overload >= OVERLOAD_FAR_DETAIL && distance > FAR_DISTANCE &&
+        staleness < FAR_REFRESH) continue;
+
+    uint32_t priority = staleness * (changed ? 4 : 1) * 1024 / (1024 + distance);
+    uint8_t j = num_of_candidates++;
+    for (; j > 0 && priorities[j - 1] < priority; j--) {
+      candidates[j] = candidates[j - 1];
+      priorities[j] = priorities[j - 1];
+    }
+    candidates[j] = i;
+    priorities[j] = priority;
+  }
+
+  //Fit as many as the budget allows, the rest goes out next time
+  uint8_t count = num_of_candidates;
+  if (app.peer_budget && !peer_state->relay) {
+    int budget_bits = ((int)peer_state->budget - PACKET_OVERHEAD - 1) * 8 - 9;
+    int fits = budget_bits > 0 ? budget_bits / (8 + SNAPSHOT_PLAYER_BITS) : 0;
+    if (fits < count) {
+      count = fits;
+      peer_state->over_budget = 1;
+    }
+  }
+  if (!count) return;
+  peer_state->ticks_since_snapshot = 0;
+  peer_state->snapshot_entities = count;
+
+  // Create memory block containing the chosen player positions, bit packed
+  int sizeof_data = sizeof(uint8_t);
+  sizeof_data += BITS_TO_BYTES(9 + count * (8 + SNAPSHOT_PLAYER_BITS));
+  uint8_t *data = malloc(sizeof_data);
+  Bit_writer writer = { &data[1], sizeof_data - 1 };
+
+  data[0] = HOST_STATE_PACKET;
+  write_bits(&writer, count, 8);
+  write_bits(&writer, count < app.num_of_players, 1);
+
+  for (uint8_t i = 0; i < count; i++) {
+    Player *player = &app.players[candidates[i]];
+
+    write_quantized(&writer, &QUANT_ID, player->id);
+    write_quantized(&writer, &app.quant_x, FIXED_TO_FLOAT(player->pos_x));
+    write_quantized(&writer, &app.quant_y, FIXED_TO_FLOAT(player->pos_y));
+    write_angle(&writer, FIXED_ROUND(player->angle));
+
+    peer_state->last_sent[player->id] = snapshot_state(player);
+    peer_state->staleness[player->id] = 0;
+  }
+
+  net_peer_send(peer, data, sizeof_data);
+
+  //Cleanup
+  free(data);
+}
+
+//Give every peer the snapshot its own schedule & budget allow
+void send_enet_host_states() {
+  for (size_t i = 0; i < app.server->peerCount && i < MAX_PEERS; i++) {
+    ENetPeer *peer = &app.server->peers[i];
+    if (peer->state != ENET_PEER_STATE_CONNECTED) continue;
+
+    schedule_peer(peer);
+    send_enet_host_state(peer);
+  }
+}
+
+//Pack the oldest events after an ack into a new packet, returns how many
+uint8_t encode_events(uint16_t *event_ack, uint8_t **data, size_t *size) {
+  /* PACKET STRUCTURE
+  ----------------------------------------------------------------
+  |  flag  | seq (16b) | count (8b) | type (2b) | p_id (8b) | ...
+  ----------------------------------------------------------------
+  A new bullet continues with pos_x (xb), pos_y (yb), angle (9b)
+  & a hit with the id of the player that was hit (8b)
+  */
+  uint16_t pending = app.event_seq - *event_ack;
+
+  if (!pending) return 0; //All caught up
+
+  //Older events were overwritten in the log, they are lost to the receiver
+  if (pending > EVENT_LOG_SIZE) {
+    *event_ack = app.event_seq - EVENT_LOG_SIZE;
+    pending = EVENT_LOG_SIZE;
+  }
+
+  // Create memory block containing the oldest unacknowledged events
+  uint8_t count = pending < EVENTS_PER_PACKET ? pending : EVENTS_PER_PACKET;
+  int sizeof_data = sizeof(uint8_t);
+  sizeof_data += BITS_TO_BYTES(24 + count * (EVENT_TYPE_BITS + 8 + SNAPSHOT_PLAYER_BITS));
+  *data = malloc(sizeof_data);
+  Bit_writer writer = { &(*data)[1], sizeof_data - 1 };
+  uint16_t seq = *event_ack + 1;
+
+  (*data)[0] = HOST_EVENTS_PACKET;
+  write_bits(&writer, seq, 16);
+  write_bits(&writer, count, 8);
+
+  for (uint8_t i = 0; i < count; i++) {
+    write_event(&writer, &app.events[(uint16_t)(seq + i) % EVENT_LOG_SIZE]);
+  }
+
+  *size = BITS_TO_BYTES(writer.bit) + 1;
+  return count;
+}
+
+void send_enet_host_events(ENetPeer *peer) {
+  uint8_t *data;
+  size_t size;
+
+  //Repeated until the peer acknowledges them
+  if (!encode_events(&app.peers[peer->incomingPeerID].event_ack, &data, &size)) return;
+  net_peer_send(peer, data, size);
+
+  //Cleanup
+  free(data);
+}
+
+//Send every peer one batch of the events it hasn't acknowledged yet
+void flush_enet_host_events(ENetHost *host) {
+  for (size_t i = 0; i < host->peerCount && i < MAX_PEERS; i++) {
+    ENetPeer *peer = &host->peers[i];
+    if (peer->state == ENET_PEER_STATE_CONNECTED) send_enet_host_events(peer);
+  }
+}
+
+void send_enet_client_state() {
+  /* PACKET STRUCTURE
+  ----------------------------------------------------------------------------------
+  |  flag  |   up   |  down  |  left  | right  | but_a  | but_b  |   event_ack    |
+  ----------------------------------------------------------------------------------
+  */
+
+  Client_state_message message = {
+    app.up, app.down, app.left, app.right, app.button_a, app.button_b, app.event_ack
+  };
+  uint8_t data[CLIENT_STATE_SIZE];
+
+  encode_client_state(data, &message);
+  net_peer_send(app.peer, data, sizeof(data));
+}
+
+void send_enet() {
+  netem_release_due(&app.netem_out);
+
+  if (app.server) {
+    send_enet_host_states();
+    flush_enet_host_events(app.server);
+    enet_host_flush(app.server); //Don't hold the tick's packets until next poll
+  }
+  else if (app.client && app.connection_state == CONNECTION_CONNECTED) {
+    send_enet_client_state();
+  }
+
+  if (app.relay_host) {
+    flush_enet_host_events(app.relay_host);
+    enet_host_flush(app.relay_host);
+  }
+}
+
+/* Relay logic */
+//Hold a copy of an upstream packet until the delay has passed
+void relay_enqueue(uint8_t *data, size_t size) {
+  Relay_queue *queue = &app.relay_queue;
+  if (queue->size == RELAY_QUEUE_SIZE) {
+    fprintf(stderr, "Relay queue is full, releasing early.\n");
+    queue->packets[queue->front].release = 0;
+    relay_release_due();
+  }
+
+  Relay_packet *packet = &queue->packets[queue->back];
+  packet->release = get_time_ns() + (uint64_t)app.relay_delay * 1000000;
+  packet->data = malloc(size);
+  packet->size = size;
+  memcpy(packet->data, data, size);
+
+  queue->back = (queue->back + 1) % RELAY_QUEUE_SIZE;
+  queue->size++;
+}
+
+void relay_clear() {
+  Relay_queue *queue = &app.relay_queue;
+
+  while (queue->size) {
+    free(queue->packets[queue->front].data);
+    queue->front = (queue->front + 1) % RELAY_QUEUE_SIZE;
+    queue->size--;
+  }
+}
+
+//Acknowledge new events upstream right away, only the new ones are held back
+void relay_receive_events(uint8_t *data, size_t size) {
+  Bit_reader reader = { &data[1], size - 1 };
+  uint16_t seq = read_bits(&reader, 16);
+  uint8_t count = read_bits(&reader, 8);
+  Game_event events[UINT8_MAX + 1];
+  uint8_t num_of_events = 0;
+
+  for (uint8_t i = 0; i < count; i++, seq++) {
+    Game_event event;
+    read_event(&reader, &event);
+    if (reader.overflow) break;
+
+    if ((int16_t)(seq - app.event_ack) <= 0) continue;
+    events[num_of_events++] = event;
+    app.event_ack = seq;
+  }
+  if (!num_of_events) return;
+
+  /* PACKET STRUCTURE
+  -----------------------------------------------------
+  |  flag  | count (8b) | type (2b) | p_id (8b) | ...
+  -----------------------------------------------------
+  Relay internal, events are laid out like in HOST_EVENTS_PACKET
+  */
+  int sizeof_data = sizeof(uint8_t);
+  sizeof_data += BITS_TO_BYTES(8 + num_of_events *
+                               (EVENT_TYPE_BITS + 8 + SNAPSHOT_PLAYER_BITS));
+  uint8_t *relayed = malloc(sizeof_data);
+  Bit_writer writer = { &relayed[1], sizeof_data - 1 };
+
+  relayed[0] = HOST_EVENTS_PACKET;
+  write_bits(&writer, num_of_events, 8);
+  for (uint8_t i = 0; i < num_of_events; i++) write_event(&writer, &events[i]);
+
+  relay_enqueue(relayed, BITS_TO_BYTES(writer.bit) + 1);
+
+  //Cleanup
+  free(relayed);
+}
+
+void relay_receive(uint8_t *data, size_t size) {
+  //Full state blocks are acknowledged on arrival too, they start with
+  //the version & the event sequence they cover
+  if (data[0] == HOST_WELCOME_PACKET) {
+    memcpy(&app.event_ack, &data[4], sizeof(uint16_t));
+  }
+  else if (data[0] == HOST_FULL_STATE_PACKET) {
+    memcpy(&app.event_ack, &data[2], sizeof(uint16_t));
+  }
+
+  if (data[0] == HOST_WELCOME_PACKET) {
+    app.connection_state = CONNECTION_CONNECTED;
+    app.connect_attempts = 0;
+    printf("Relaying host %s with a %u ms delay.\n", app.ip_address, app.relay_delay);
+  }
+  else if (app.connection_state != CONNECTION_CONNECTED) { return; }
+
+  if (data[0] == HOST_EVENTS_PACKET) { relay_receive_events(data, size); }
+  else { relay_enqueue(data, size); }
+}
+
+//Apply held back events to the mirror & log them for the spectators
+void relay_apply_events(uint8_t *data, size_t size) {
+  Bit_reader reader = { &data[1], size - 1 };
+  uint8_t count = read_bits(&reader, 8);
+
+  for (uint8_t i = 0; i < count; i++) {
+    Game_event event;
+    read_event(&reader, &event);
+    if (reader.overflow) return;
+
+    if (event.type == EVENT_NEW_BULLET) handle_client_event_new_bullet(&event);
+    else if (event.type == EVENT_PLAYER_HIT) handle_client_event_player_hit(&event);
+    queue_event(&event);
+  }
+}
+
+void relay_welcome_spectators() {
+  for (size_t i = 0; i < app.relay_host->peerCount; i++) {
+    ENetPeer *peer = &app.relay_host->peers[i];
+    if (peer->state != ENET_PEER_STATE_CONNECTED) continue;
+
+    app.peers[peer->incomingPeerID].event_ack = app.event_seq;
+    host_send_welcome(peer);
+  }
+}
+
+void relay_resync_spectators() {
+  for (size_t i = 0; i < app.relay_host->peerCount; i++) {
+    ENetPeer *peer = &app.relay_host->peers[i];
+    if (peer->state == ENET_PEER_STATE_CONNECTED) host_send_full_state(peer);
+  }
+}
+
+//Apply a held back packet to the mirror & pass it on to the spectators
+void relay_release(uint8_t *data, size_t size) {
+  uint16_t event_ack = app.event_ack; //Acknowledged on arrival, not on release
+
+  if (data[0] == HOST_WELCOME_PACKET) {
+    //A rejected welcome leaves the spectators with what they had, not half a world
+    if (apply_welcome(data, size) == 0) {
+      if (!app.relay_host && init_relay_host() == EXIT_FAILURE) exit(EXIT_FAILURE);
+      relay_welcome_spectators();
+    }
+  }
+  else if (data[0] == HOST_FULL_STATE_PACKET) {
+    handle_client_packet_full_state(data, size);
+    relay_resync_spectators();
+  }
+  else if (data[0] == HOST_EVENTS_PACKET) { relay_apply_events(data, size); }
+  else {
+    host_packet_dispatch[data[0]].handler(data, size); //Checked on arrival
+    if (app.relay_host) net_host_broadcast(app.relay_host, data, size);
+  }
+
+  app.event_ack = event_ack;
+}
+
+void relay_release_due() {
+  Relay_queue *queue = &app.relay_queue;
+  uint64_t now = get_time_ns();
+
+  while (queue->size && queue->packets[queue->front].release <= now) {
+    Relay_packet packet = queue->packets[queue->front];
+    queue->front = (queue->front + 1) % RELAY_QUEUE_SIZE;
+    queue->size--;
+
+    relay_release(packet.data, packet.size);
+    free(packet.data);
+  }
+}
+
+/* Network emulator logic */
+uint8_t netem_chance(float chance) {
+  return (float)rand() / ((float)RAND_MAX + 1) < chance;
+}
+
+void netem_send(ENetPeer *peer, uint8_t channel, ENetPacket *packet) {
+  if (enet_peer_send(peer, channel, packet) < 0) enet_packet_destroy(packet);
+}
+
+//A relay's upstream & its spectators share peer ids, the upstream gets the spare link
+int netem_link(ENetPeer *peer) {
+  if (peer->host == app.client) return MAX_PEERS;
+  return peer->incomingPeerID % MAX_PEERS;
+}
+
+//Keep the queue sorted by release, packets released together keep their order
+void netem_insert(Netem *netem, uint64_t release, ENetPeer *peer, uint8_t channel,
+                  ENetPacket *packet, uint32_t sequence) {
+  if (netem->size == NETEM_QUEUE_SIZE) {
+    fprintf(stderr, "Network emulator queue is full, releasing early.\n");
+    netem->packets[0].release = 0;
+    netem_release_due(netem);
+  }
+
+  int index = netem->size;
+  while (index > 0 && netem->packets[index - 1].release > release) index--;
+
+  memmove(&netem->packets[index + 1], &netem->packets[index],
+          (netem->size - index) * sizeof(Netem_packet));
+  netem->packets[index] = (Netem_packet){ release, peer, packet, channel, sequence };
+  netem->size++;
+}
+
+//Hold a packet back as if it crossed a link with the configured conditions
+void netem_enqueue(Netem *netem, ENetPeer *peer, uint8_t channel, ENetPacket *packet) {
+  uint8_t reliable = (packet->flags & ENET_PACKET_FLAG_RELIABLE) != 0;
+  int link = netem_link(peer);
+  uint64_t now = get_time_ns();
+  uint64_t depart = now;
+
+  if (!netem->deliver) netem->deliver = netem == &app.netem_in ? net_deliver : netem_send;
+
+  //Serialize onto the link, a full buffer drops what ENet wouldn't resend
+  if (netem->rate) {
+    if (netem->link_free[link] > depart) depart = netem->link_free[link];
+    if (!reliable && depart - now > (uint64_t)NETEM_BACKLOG * 1000000) {
+      enet_packet_destroy(packet);
+      return;
+    }
+    depart += (uint64_t)(packet->dataLength + PACKET_OVERHEAD) * 1000000000 / netem->rate;
+    netem->link_free[link] = depart;
+  }
+
+  uint64_t delay = netem->latency + (netem->jitter ? rand() % (netem->jitter + 1) : 0);
+
+  //Lost reliable packets show up a retransmission later, in order
+  if (netem_chance(netem->loss)) {
+    if (!reliable) {
+      enet_packet_destroy(packet);
+      return;
+    }
+    delay += 2 * netem->latency;
+  }
+
+  //Unreliable packets are sequenced unless flagged otherwise
+  uint32_t sequence = 0;
+  if (!reliable && !(packet->flags & ENET_PACKET_FLAG_UNSEQUENCED)) {
+    sequence = ++netem->sent_sequence[link][channel % CHANNEL_COUNT];
+  }
+
+  uint64_t release = depart + delay * 1000000;
+  if (reliable) {
+    if (release < netem->last_reliable[link]) release = netem->last_reliable[link];
+    netem->last_reliable[link] = release;
+  }
+
+  netem_insert(netem, release, peer, channel, packet, sequence);
+}
+
+void netem_release_due(Netem *netem) {
+  uint64_t now = get_time_ns();
+  int released = 0;
+
+  while (released < netem->size && netem->packets[released].release <= now) released++;
+  if (!released) return;
+
+  //Take them out first, delivering may queue more
+  Netem_packet due[released];
+  memcpy(due, netem->packets, released * sizeof(Netem_packet));
+  netem->size -= released;
+  memmove(netem->packets, &netem->packets[released], netem->size * sizeof(Netem_packet));
+
+  for (int i = 0; i < released; i++) {
+    //A sequenced packet overtaken by a newer one is dropped on arrival
+    if (due[i].sequence) {
+      uint32_t *last = &netem->released_sequence[netem_link(due[i].peer)]
+                                                [due[i].channel % CHANNEL_COUNT];
+      if (due[i].sequence <= *last) {
+        enet_packet_destroy(due[i].packet);
+        continue;
+      }
+      *last = due[i].sequence;
+    }
+
+    netem->deliver(due[i].peer, due[i].channel, due[i].packet);
+  }
+}
+
+//Forget what's in flight from or to a peer that went away
+void netem_drop_peer(Netem *netem, ENetPeer *peer) {
+  int link = netem_link(peer);
+  int kept = 0;
+
+  for (int i = 0; i < netem->size; i++) {
+    if (netem->packets[i].peer == peer) { enet_packet_destroy(netem->packets[i].packet); }
+    else { netem->packets[kept++] = netem->packets[i]; }
+  }
+  netem->size = kept;
+
+  netem->link_free[link] = 0;
+  netem->last_reliable[link] = 0;
+  memset(netem->sent_sequence[link], 0, sizeof(netem->sent_sequence[link]));
+  memset(netem->released_sequence[link], 0, sizeof(netem->released_sequence[link]));
+}
+
+//Milliseconds until the next emulated packet is due, capped by timeout (-1 waits forever)
+int netem_wait_time(int timeout) {
+  Netem *queues[] = { &app.netem_in, &app.netem_out };
+  uint64_t now = get_time_ns();
+
+  for (int i = 0; i < 2; i++) {
+    if (!queues[i]->size) continue;
+
+    uint64_t release = queues[i]->packets[0].release;
+    int wait = release > now ? (release - now + 999999) / 1000000 : 0;
+    if (timeout < 0 || wait < timeout) timeout = wait;
+  }
+
+  return timeout;
+}
+
+/* Recording logic */
+int init_record() {
+  if (!app.record_path) return 0; //Recording is optional
+  if (!app.server) {
+    fprintf(stderr, "Only a host can record.\n");
+    return EXIT_FAILURE;
+  }
+
+  Recorder *recorder = &app.recorder;
+  recorder->file = fopen(app.record_path, "wb");
+  if (!recorder->file) {
+    fprintf(stderr, "Failed to open recording %s.\n", app.record_path);
+    return EXIT_FAILURE;
+  }
+
+  Record_header header = {0};
+  memcpy(header.magic, "TNKR", 4);
+  header.version = RECORD_VERSION;
+  header.tick_rate = app.tick_rate;
+  header.keyframe_interval = RECORD_KEYFRAME_INTERVAL;
+  header.map_size = app.map.image_size;
+
+  fwrite(&header, sizeof(Record_header), 1, recorder->file);
+  fwrite(app.map.image, 1, app.map.image_size, recorder->file);
+  recorder->event_seq = app.event_seq;
+
+  return 0;
+}
+
+/* RECORD STRUCTURE
+------------------------------------------------------------
+|           tick            |           size            | packet ...
+------------------------------------------------------------
+Packets are recorded as a spectator would receive them
+*/
+void record_packet(uint8_t *data, size_t size) {
+  Recorder *recorder = &app.recorder;
+  if (!recorder->file) return;
+
+  uint32_t size_u32 = size;
+  fwrite(&recorder->tick, sizeof(uint32_t), 1, recorder->file);
+  fwrite(&size_u32, sizeof(uint32_t), 1, recorder->file);
+  fwrite(data, 1, size, recorder->file);
+
+  //A join only carries whole pixels, follow it with the exact spot
+  if (data[0] == HOST_PLAYER_JOINED_PACKET) recorder->last_state[data[1]] = UINT64_MAX;
+}
+
+//Full state of the tick, playback seeks to these
+void record_keyframe() {
+  Recorder *recorder = &app.recorder;
+
+  if (recorder->num_of_keyframes == recorder->keyframes_capacity) {
+    uint32_t capacity = recorder->keyframes_capacity ? 2 * recorder->keyframes_capacity : 64;
+    uint64_t *keyframes = realloc(recorder->keyframes, capacity * sizeof(uint64_t));
+
+    //Close it with the keyframes indexed so far, it stays playable up to here
+    if (!keyframes) {
+      fprintf(stderr, "Out of memory for the keyframe index, stopping the recording.\n");
+      finish_record();
+      return;
+    }
+    recorder->keyframes = keyframes;
+    recorder->keyframes_capacity = capacity;
+  }
+  recorder->keyframes[recorder->num_of_keyframes++] = ftell(recorder->file);
+
+  int sizeof_data = sizeof(uint8_t) + full_state_size();
+  uint8_t *data = malloc(sizeof_data);
+
+  data[0] = HOST_FULL_STATE_PACKET;
+  write_full_state(&data[1]);
+  record_packet(data, sizeof_data);
+
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    recorder->last_state[app.players[i].id] = snapshot_state(&app.players[i]);
+  }
+
+  free(data);
+}
+
+//Snapshot of the players that changed since the last record
+void record_state() {
+  Recorder *recorder = &app.recorder;
+  uint8_t changed[MAX_PLAYERS];
+  uint8_t count = 0;
+
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    Player *player = &app.players[i];
+    if (snapshot_state(player) != recorder->last_state[player->id]) changed[count++] = i;
+  }
+  if (!count) return;
+
+  // Create memory block laid out like HOST_STATE_PACKET
+  int sizeof_data = sizeof(uint8_t);
+  sizeof_data += BITS_TO_BYTES(9 + count * (8 + SNAPSHOT_PLAYER_BITS));
+  uint8_t *data = malloc(sizeof_data);
+  Bit_writer writer = { &data[1], sizeof_data - 1 };
+
+  data[0] = HOST_STATE_PACKET;
+  write_bits(&writer, count, 8);
+  write_bits(&writer, count < app.num_of_players, 1);
+
+  for (uint8_t i = 0; i < count; i++) {
+    Player *player = &app.players[changed[i]];
+
+    write_quantized(&writer, &QUANT_ID, player->id);
+    write_quantized(&writer, &app.quant_x, FIXED_TO_FLOAT(player->pos_x));
+    write_quantized(&writer, &app.quant_y, FIXED_TO_FLOAT(player->pos_y));
+    write_angle(&writer, FIXED_ROUND(player->angle));
+
+    recorder->last_state[player->id] = snapshot_state(player);
+  }
+
+  record_packet(data, sizeof_data);
+  free(data);
+}
+
+void record_tick() {
+  Recorder *recorder = &app.recorder;
+  uint8_t *data;
+  size_t size;
+  uint8_t count;
+
+  //Every event since the last tick, the log can hold more than a packet's worth
+  while ((count = encode_events(&recorder->event_seq, &data, &size))) {
+    record_packet(data, size);
+    recorder->event_seq += count;
+    free(data);
+  }
+
+  if (recorder->tick % RECORD_KEYFRAME_INTERVAL == 0) { record_keyframe(); }
+  else { record_state(); }
+
+  recorder->tick++;
+}
+
+//Append the keyframe index, a recording cut short is still playable without it
+void finish_record() {
+  Recorder *recorder = &app.recorder;
+  if (!recorder->file) return;
+
+  uint64_t padding = 0;
+  fwrite(&padding, 1, (8 - ftell(recorder->file) % 8) % 8, recorder->file);
+
+  Record_trailer trailer = {0};
+  trailer.index_offset = ftell(recorder->file);
+  trailer.num_of_keyframes = recorder->num_of_keyframes;
+  trailer.num_of_ticks = recorder->tick;
+  memcpy(trailer.magic, "TNKI", 4);
+
+  fwrite(recorder->keyframes, sizeof(uint64_t), recorder->num_of_keyframes, recorder->file);
+  fwrite(&trailer, sizeof(Record_trailer), 1, recorder->file);
+  fclose(recorder->file);
+  free(recorder->keyframes);
+  recorder->file = NULL;
+
+  printf("Recorded %u ticks to %s.\n", trailer.num_of_ticks, app.record_path);
+}
+
+/* Replay logic */
+//The record at an offset, NULL past the last complete one
+uint8_t *replay_record(size_t offset, uint32_t *tick, uint32_t *size) {
+  Replay *replay = &app.replay;
+
+  if (offset + 2 * sizeof(uint32_t) > replay->end) return NULL;
+  memcpy(tick, &replay->data[offset], sizeof(uint32_t));
+  memcpy(size, &replay->data[offset + 4], sizeof(uint32_t));
+  if (*size > replay->end - offset - 2 * sizeof(uint32_t)) return NULL;
+
+  return &replay->data[offset + 2 * sizeof(uint32_t)];
+}
+
+//Use the index a closed recording ends with
+int replay_read_index() {
+  Replay *replay = &app.replay;
+  Record_trailer trailer;
+
+  if (replay->size < replay->end + sizeof(Record_trailer)) return EXIT_FAILURE;
+  memcpy(&trailer, &replay->data[replay->size - sizeof(Record_trailer)], sizeof(Record_trailer));
+
+  if (memcmp(trailer.magic, "TNKI", 4) != 0) return EXIT_FAILURE;
+  if (trailer.index_offset % 8 || trailer.index_offset < replay->end) return EXIT_FAILURE;
+  if (trailer.index_offset + (uint64_t)trailer.num_of_keyframes * sizeof(uint64_t) >
+      replay->size - sizeof(Record_trailer)) return EXIT_FAILURE;
+
+  //Used in place, the mapping is page aligned
+  replay->keyframes = (const uint64_t *)&replay->data[trailer.index_offset];
+  replay->num_of_keyframes = trailer.num_of_keyframes;
+  replay->num_of_ticks = trailer.num_of_ticks;
+  replay->end = trailer.index_offset;
+
+  return 0;
+}
+
+//A recording cut short has no index, find its keyframes by walking the records
+void replay_scan_index() {
+  Replay *replay = &app.replay;
+  size_t offset = replay->end;
+  uint32_t capacity = 0;
+  uint32_t tick, size;
+  uint8_t *packet;
+
+  replay->end = replay->size;
+  while ((packet = replay_record(offset, &tick, &size))) {
+    if (size && packet[0] == HOST_FULL_STATE_PACKET && tick % replay->interval == 0 &&
+        tick / replay->interval == replay->num_of_keyframes) {
+      if (replay->num_of_keyframes == capacity) {
+        uint32_t grown = capacity ? 2 * capacity : 64;
+        uint64_t *index = realloc(replay->index, grown * sizeof(uint64_t));
+        if (!index) break; //Play up to the keyframes found so far
+        replay->index = index;
+        capacity = grown;
+      }
+      replay->index[replay->num_of_keyframes++] = offset;
+    }
+
+    replay->num_of_ticks = tick + 1;
+    offset += 2 * sizeof(uint32_t) + size;
+  }
+
+  replay->keyframes = replay->index;
+  replay->end = offset;
+}
+
+//Apply the records of every tick up to one
+void replay_apply(uint32_t tick) {
+  Replay *replay = &app.replay;
+  uint32_t record_tick, size;
+  uint8_t *packet;
+
+  while ((packet = replay_record(replay->cursor, &record_tick, &size)) && record_tick <= tick) {
+    replay->cursor += 2 * sizeof(uint32_t) + size;
+
+    const Packet_dispatch *dispatch = validate_packet(host_packet_dispatch,
+                                                      HOST_PACKET_COUNT, packet, size);
+    if (!dispatch || packet[0] == HOST_WELCOME_PACKET) continue; //Never recorded
+
+    if (packet[0] != HOST_FULL_STATE_PACKET) { dispatch->handler(packet, size); }
+    else if (apply_full_state(&packet[1], size - 1) < 0) {
+      fprintf(stderr, "Found an invalid keyframe in the recording.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+//Jump to a tick from the keyframe before it, playing the ticks in between
+void replay_seek(uint32_t target) {
+  Replay *replay = &app.replay;
+
+  if (target >= replay->num_of_ticks) target = replay->num_of_ticks - 1;
+  uint32_t keyframe = target / replay->interval;
+  if (keyframe >= replay->num_of_keyframes) keyframe = replay->num_of_keyframes - 1;
+
+  replay->cursor = replay->keyframes[keyframe];
+  replay->tick = keyframe * replay->interval;
+
+  for (; replay->tick < target; replay->tick++) {
+    if (replay->tick > keyframe * replay->interval) update(); //Bullets keep flying
+    replay_apply(replay->tick);
+  }
+  replay->seek = target;
+}
+
+int init_replay(char *path) {
+  Replay *replay = &app.replay;
+  Record_header header;
+  struct stat file_stat;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &file_stat) < 0 || file_stat.st_size < (off_t)sizeof(Record_header)) {
+    if (fd >= 0) close(fd);
+    fprintf(stderr, "Failed to open recording %s.\n", path);
+    return EXIT_FAILURE;
+  }
+
+  void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s.\n", path);
+    return EXIT_FAILURE;
+  }
+  replay->data = mapping;
+  replay->size = file_stat.st_size;
+
+  //The map is used in place
+  memcpy(&header, replay->data, sizeof(Record_header));
+  replay->end = sizeof(Record_header) + (uint64_t)header.map_size;
+  if (memcmp(header.magic, "TNKR", 4) != 0 || header.version != RECORD_VERSION ||
+      header.tick_rate < TICK_RATE_MIN || header.tick_rate > TICK_RATE_MAX ||
+      !header.keyframe_interval || replay->end > replay->size ||
+      load_map_image(&replay->data[sizeof(Record_header)], header.map_size) == EXIT_FAILURE) {
+    fprintf(stderr, "%s is not a valid version %d recording.\n", path, RECORD_VERSION);
+    return EXIT_FAILURE;
+  }
+  app.tick_rate = header.tick_rate;
+  replay->interval = header.keyframe_interval;
+
+  if (replay_read_index() == EXIT_FAILURE) {
+    printf("%s wasn't closed, rebuilding its index.\n", path);
+    replay_scan_index();
+  }
+  if (!replay->num_of_keyframes || replay->keyframes[0] >= replay->end) {
+    fprintf(stderr, "%s has no keyframes.\n", path);
+    return EXIT_FAILURE;
+  }
+  if (!replay->num_of_ticks) { //Seeking clamps to the last tick
+    fprintf(stderr, "%s has no ticks.\n", path);
+    return EXIT_FAILURE;
+  }
+
+  replay_seek(replay->seek);
+  replay->start = get_time_ns();
+  printf("Playing %u ticks from tick %u.\n", replay->num_of_ticks, replay->seek);
+
+  return 0;
+}
+
+void replay_tick() {
+  Replay *replay = &app.replay;
+
+  replay_apply(replay->tick++);
+  if (replay->tick < replay->num_of_ticks) return;
+
+  double seconds = (get_time_ns() - replay->start) / 1e9;
+  uint32_t played = replay->num_of_ticks - replay->seek;
+  printf("Played %u ticks in %.2f s, %.0f ticks per second.\n",
+    played, seconds, seconds > 0 ? played / seconds : 0);
+  app.is_running = 0;
+}
+
+/* Scheduler logic */
+uint64_t get_time_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//Speeds are given per default tick, keep them per second at any tick rate
+fixed scale_speed(int speed) {
+  return (int64_t)INT_TO_FIXED(speed) * TICK_RATE / app.tick_rate;
+}
+
+//Nanoseconds between ticks, 0 when a replay runs unpaced
+uint64_t tick_length() {
+  if (app.speed <= 0) return 0;
+  return 1000000000 / (app.tick_rate * app.speed);
+}
+
+int init_tick_timer() {
+  app.tick_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (app.tick_timer < 0) {
+    fprintf(stderr, "Failed to create the tick timer.\n");
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+//Block until the next tick is due, servicing ENet whenever traffic arrives
+void wait_for_tick() {
+  ENetHost *hosts[] = { app.server, app.client, app.relay_host };
+  struct pollfd fds[4] = { { .fd = app.tick_timer, .events = POLLIN } };
+  nfds_t num_of_fds = 1;
+
+  for (int i = 0; i < 3; i++) {
+    if (!hosts[i]) continue;
+    fds[num_of_fds].fd = hosts[i]->socket;
+    fds[num_of_fds++].events = POLLIN;
+  }
+
+  //Nothing to simulate, sleep until someone connects
+  while (app.server && !app.num_of_players && app.is_running) {
+    uint64_t blocked = get_time_ns();
+    poll(&fds[1], 1, netem_wait_time(IDLE_TIMEOUT));
+    app.blocked_ns += get_time_ns() - blocked;
+    poll_enet();
+    app.next_tick = get_time_ns();
+    export_stats();
+  }
+
+  struct itimerspec deadline = {0};
+  deadline.it_value.tv_sec = app.next_tick / 1000000000;
+  deadline.it_value.tv_nsec = app.next_tick % 1000000000;
+  timerfd_settime(app.tick_timer, TFD_TIMER_ABSTIME, &deadline, NULL);
+
+  while (app.is_running) {
+    uint64_t blocked = get_time_ns();
+    int ready = poll(fds, num_of_fds, netem_wait_time(-1));
+    app.blocked_ns += get_time_ns() - blocked;
+    if (ready == 0) { poll_enet(); continue; } //An emulated packet is due
+    if (ready < 0) continue; //Interrupted
+
+    for (nfds_t i = 1; i < num_of_fds; i++) {
+      if (fds[i].revents & POLLIN) { poll_enet(); break; }
+    }
+    if (fds[0].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(app.tick_timer, &expirations, sizeof(expirations)) > 0) break;
+    }
+  }
+}
+
+void schedule_next_tick() {
+  uint64_t tick_ns = tick_length();
+  uint64_t now = get_time_ns();
+
+  app.next_tick += tick_ns;
+
+  //Running too far behind, drop the missed ticks instead of spiraling
+  if (now > app.next_tick + MAX_CATCHUP_TICKS * tick_ns) app.next_tick = now;
+}
+
+void init_frame_pacer() {
+  //Without VSync cap the frame rate unless asked otherwise
+  if (app.fps_cap < 0) app.fps_cap = app.vsync ? 0 : FPS_CAP;
 
-  // Create memory block containing the local app state
-  int sizeof_data = 7 * sizeof(uint8_t);
-  uint8_t *data = malloc(sizeof_data);
-  ENetPacket *packet;
+  app.next_frame = get_time_ns();
+  app.frame_start = app.next_frame;
+  app.frame_report_start = app.next_frame;
+}
 
-  data[0] = CLIENT_STATE_PACKET;
-  data[1] = app.up;
-  data[2] = app.down;
-  data[3] = app.left;
-  data[4] = app.right;
-  data[5] = app.button_a;
-  data[6] = app.button_b;
+void report_frame_times(uint64_t now) {
+  if (now - app.frame_report_start < 1000000000) return;
 
-  packet = enet_packet_create(data, sizeof_data, ENET_PACKET_FLAG_UNSEQUENCED);
-  enet_peer_send(app.peer, 0, packet);
+  printf("Frames: %u, average %.2f ms, worst %.2f ms, over budget %u\n",
+    app.frames, app.frame_time_total / 1e6 / app.frames,
+    app.frame_time_worst / 1e6, app.frames_over_budget);
 
-  // Cleanup
-  free(data);
+  app.frames = 0;
+  app.frames_over_budget = 0;
+  app.frame_time_total = 0;
+  app.frame_time_worst = 0;
+  app.frame_report_start = now;
 }
 
-void send_enet() {
-  if (app.server) { send_enet_host_state(); }
-  else if (app.client) { send_enet_client_state(); }
+//Sleep until the next frame deadline, uncapped frames only get measured
+void pace_frame() {
+  uint64_t budget = app.fps_cap ? 1000000000 / app.fps_cap : 0;
+  uint64_t now = get_time_ns();
+  uint64_t frame_time = now - app.frame_start;
+
+  app.frames++;
+  app.frame_time_total += frame_time;
+  if (frame_time > app.frame_time_worst) app.frame_time_worst = frame_time;
+  if (budget && frame_time > budget) app.frames_over_budget++;
+
+  if (budget) {
+    app.next_frame += budget;
+
+    //Missed the deadline by a whole frame, start over instead of bursting
+    if (now > app.next_frame + budget) { app.next_frame = now; }
+    else {
+      struct timespec deadline = {
+        .tv_sec = app.next_frame / 1000000000,
+        .tv_nsec = app.next_frame % 1000000000
+      };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL));
+    }
+  }
+  else if (!app.vsync) { report_frame_times(now); } //Benchmark mode
+
+  app.frame_start = get_time_ns();
 }
 
 /* SDL Logic */
 uint8_t init_SDL() {
+  //Headless hosts only need the timer
+  if (app.headless) {
+    if (SDL_Init(SDL_INIT_TIMER) < 0) {
+      fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+    return 0;
+  }
+
   //Init SDL
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
     fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
@@ -683,12 +3422,21 @@ uint8_t init_SDL() {
   }
 
   //Create renderer
-  app.renderer = SDL_CreateRenderer(app.window, -1, SDL_RENDERER_ACCELERATED);
+  uint32_t flags = SDL_RENDERER_ACCELERATED;
+  if (app.vsync) flags |= SDL_RENDERER_PRESENTVSYNC;
+
+  app.renderer = SDL_CreateRenderer(app.window, -1, flags);
   if (!app.renderer) {
     fprintf(stderr, "Failed to initialize a renderer: %s\n", SDL_GetError());
     return EXIT_FAILURE;
   }
 
+  //Every tank is drawn from one texture
+  if (init_sprite_batch(&app.tanks, "tank.png") == EXIT_FAILURE) {
+    fprintf(stderr, "Failed to load player texture: %s\n", SDL_GetError());
+    return EXIT_FAILURE;
+  }
+
   return 0;
 }
 
@@ -744,74 +3492,528 @@ SDL_Texture *loadTexture(char *filename) {
   return texture;
 }
 
-//Copy texture to a rectangle
-void blit(SDL_Texture *texture, int x, int y, int16_t angle) {
-  SDL_Rect dest = { x, y };
+/* Sprite batch logic */
+int init_sprite_batch(Sprite_batch *batch, char *filename) {
+  int w, h;
+
+  batch->texture = loadTexture(filename);
+  if (!batch->texture) return EXIT_FAILURE;
+
+  SDL_QueryTexture(batch->texture, NULL, NULL, &w, &h);
+  batch->width = w;
+  batch->height = h;
+
+  //Two triangles per sprite, the same for every frame
+  for (int i = 0; i < MAX_PLAYERS; i++) {
+    int *index = &batch->indices[i * 6];
+    index[0] = i * 4;
+    index[1] = i * 4 + 1;
+    index[2] = i * 4 + 2;
+    index[3] = i * 4 + 2;
+    index[4] = i * 4 + 3;
+    index[5] = i * 4;
+  }
+
+  return 0;
+}
+
+//Queue the texture at a position, rotated clockwise around its center
+//like SDL_RenderCopyEx would, with sub pixel precision
+void sprite_batch_add(Sprite_batch *batch, float x, float y, float angle) {
+  if (batch->num_of_sprites == MAX_PLAYERS) return;
+
+  const float corners[4][2] = { { -0.5, -0.5 }, { 0.5, -0.5 }, { 0.5, 0.5 }, { -0.5, 0.5 } };
+  SDL_Vertex *vertex = &batch->vertices[batch->num_of_sprites++ * 4];
+  float sin_angle = sinf(angle * (float)M_PI / 180);
+  float cos_angle = cosf(angle * (float)M_PI / 180);
+  float center_x = x + batch->width / 2;
+  float center_y = y + batch->height / 2;
+
+  for (int i = 0; i < 4; i++) {
+    float corner_x = corners[i][0] * batch->width;
+    float corner_y = corners[i][1] * batch->height;
+
+    vertex[i].position.x = center_x + corner_x * cos_angle - corner_y * sin_angle;
+    vertex[i].position.y = center_y + corner_x * sin_angle + corner_y * cos_angle;
+    vertex[i].color = (SDL_Color){ 255, 255, 255, 255 };
+    vertex[i].tex_coord.x = corners[i][0] + 0.5;
+    vertex[i].tex_coord.y = corners[i][1] + 0.5;
+  }
+}
 
-  //Get texture width/height and apply to dest
-  SDL_QueryTexture(texture, NULL, NULL, &dest.w, &dest.h);
-  SDL_RenderCopyEx(app.renderer, texture, NULL, &dest, angle, NULL, SDL_FLIP_NONE);
+//Submit everything queued in one draw call
+void sprite_batch_draw(Sprite_batch *batch) {
+  if (batch->num_of_sprites) {
+    SDL_RenderGeometry(app.renderer, batch->texture, batch->vertices, batch->num_of_sprites * 4,
+                       batch->indices, batch->num_of_sprites * 6);
+  }
+  batch->num_of_sprites = 0;
 }
 
 /* Map logic */
+#define MAP_ALIGN(offset) (((offset) + 7) & ~(uint32_t)7)
+
+uint8_t map_is_solid(uint16_t x, uint16_t y) {
+  uint32_t index = (uint32_t)y * app.map.width + x;
+  return (app.map.occupancy[index / 8] >> (index % 8)) & 1;
+}
+
+//Check the tiles under a rectangle, only solid ones need the wall tests
+uint8_t map_area_is_free(SDL_Rect *rect) {
+  int x0 = rect->x < 0 ? 0 : rect->x / TILE_SIZE;
+  int y0 = rect->y < 0 ? 0 : rect->y / TILE_SIZE;
+  int x1 = (rect->x + rect->w - 1) / TILE_SIZE;
+  int y1 = (rect->y + rect->h - 1) / TILE_SIZE;
+
+  if (x1 >= app.map.width) x1 = app.map.width - 1;
+  if (y1 >= app.map.height) y1 = app.map.height - 1;
+
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      if (map_is_solid(x, y)) return 0;
+    }
+  }
+
+  return 1;
+}
+
+//Greedily merge solid tiles into maximal rectangles, row by row
+uint16_t merge_map_walls(const uint8_t *tiles, uint16_t width, uint16_t height,
+                         Map_rect *rects) {
+  uint8_t *merged = calloc(width * height, sizeof(uint8_t));
+  uint16_t num_of_rects = 0;
+
+  for (uint16_t y = 0; y < height; y++) {
+    for (uint16_t x = 0; x < width; x++) {
+      if (!tiles[y * width + x] || merged[y * width + x]) continue;
+
+      //Grow to the right, then down while the whole row below is free wall
+      uint16_t w = 1, h = 1;
+      while (x + w < width && tiles[y * width + x + w] &&
+             !merged[y * width + x + w]) w++;
+
+      while (y + h < height) {
+        uint16_t i = 0;
+        while (i < w && tiles[(y + h) * width + x + i] &&
+               !merged[(y + h) * width + x + i]) i++;
+        if (i < w) break;
+        h++;
+      }
+
+      for (uint16_t j = y; j < y + h; j++) {
+        memset(&merged[j * width + x], 1, w);
+      }
+
+      Map_rect rect = { x, y, w, h };
+      rects[num_of_rects++] = rect;
+    }
+  }
+
+  free(merged);
+  return num_of_rects;
+}
+
+//Serialize a tile grid into a map file image with precomputed metadata
+uint8_t *build_map_image(const uint8_t *tiles, uint16_t width, uint16_t height,
+                         const Map_spawn *spawns, uint16_t num_of_spawns,
+                         uint32_t *size) {
+  Map_rect *rects = malloc(width * height * sizeof(Map_rect));
+  uint16_t num_of_rects = merge_map_walls(tiles, width, height, rects);
+  Map_header header = {{'T', 'N', 'K', 'M'}, MAP_VERSION, width, height,
+                       num_of_rects, num_of_spawns};
+
+  header.tiles_offset = MAP_ALIGN(sizeof(Map_header));
+  header.occupancy_offset = MAP_ALIGN(header.tiles_offset + width * height);
+  header.rects_offset = MAP_ALIGN(header.occupancy_offset + (width * height + 7) / 8);
+  header.spawns_offset = MAP_ALIGN(header.rects_offset + num_of_rects * sizeof(Map_rect));
+  header.size = header.spawns_offset + num_of_spawns * sizeof(Map_spawn);
+
+  uint8_t *image = calloc(header.size, sizeof(uint8_t));
+  memcpy(image, &header, sizeof(Map_header));
+  memcpy(&image[header.tiles_offset], tiles, width * height);
+  memcpy(&image[header.rects_offset], rects, num_of_rects * sizeof(Map_rect));
+  memcpy(&image[header.spawns_offset], spawns, num_of_spawns * sizeof(Map_spawn));
+
+  for (uint32_t i = 0; i < (uint32_t)width * height; i++) {
+    if (tiles[i]) image[header.occupancy_offset + i / 8] |= 1 << (i % 8);
+  }
+
+  free(rects);
+  *size = header.size;
+  return image;
+}
+
+uint8_t map_section_fits(uint32_t offset, uint32_t length, uint32_t size) {
+  return offset % 8 == 0 && offset <= size && length <= size - offset;
+}
+
+//Validate a map file image & point the map into it, nothing is copied
+int load_map_image(const uint8_t *image, size_t size) {
+  Map_header header;
+
+  if (size < sizeof(Map_header)) return EXIT_FAILURE;
+  memcpy(&header, image, sizeof(Map_header));
+
+  if (memcmp(header.magic, "TNKM", 4) != 0) return EXIT_FAILURE;
+  if (header.version != MAP_VERSION || header.size != size) return EXIT_FAILURE;
+  if (!header.width || header.width > MAP_MAX_WIDTH) return EXIT_FAILURE;
+  if (!header.height || header.height > MAP_MAX_HEIGHT) return EXIT_FAILURE;
+
+  uint32_t num_of_tiles = header.width * header.height;
+  if (!map_section_fits(header.tiles_offset, num_of_tiles, size) ||
+      !map_section_fits(header.occupancy_offset, (num_of_tiles + 7) / 8, size) ||
+      !map_section_fits(header.rects_offset,
+                        header.num_of_rects * sizeof(Map_rect), size) ||
+      !map_section_fits(header.spawns_offset,
+                        header.num_of_spawns * sizeof(Map_spawn), size))
+    return EXIT_FAILURE;
+
+  const Map_rect *rects = (const Map_rect *)&image[header.rects_offset];
+  for (uint16_t i = 0; i < header.num_of_rects; i++) {
+    if (rects[i].x + rects[i].w > header.width) return EXIT_FAILURE;
+    if (rects[i].y + rects[i].h > header.height) return EXIT_FAILURE;
+  }
+
+  app.map.width = header.width;
+  app.map.height = header.height;
+  app.quant_x = position_field(header.width * TILE_SIZE);
+  app.quant_y = position_field(header.height * TILE_SIZE);
+  app.map.tiles = &image[header.tiles_offset];
+  app.map.occupancy = &image[header.occupancy_offset];
+  app.map.rects = rects;
+  app.map.num_of_rects = header.num_of_rects;
+  app.map.spawns = (const Map_spawn *)&image[header.spawns_offset];
+  app.map.num_of_spawns = header.num_of_spawns;
+  app.map.image = image;
+  app.map.image_size = size;
+
+  //Scale the merged rectangles once for collisions & drawing
+  app.map.walls = malloc(header.num_of_rects * sizeof(SDL_Rect));
+  for (uint16_t i = 0; i < header.num_of_rects; i++) {
+    SDL_Rect wall = { rects[i].x * TILE_SIZE, rects[i].y * TILE_SIZE,
+                      rects[i].w * TILE_SIZE, rects[i].h * TILE_SIZE };
+    app.map.walls[i] = wall;
+  }
+
+  return 0;
+}
+
+int load_map_file(char *path) {
+  struct stat file_stat;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &file_stat) < 0 || file_stat.st_size == 0) {
+    if (fd >= 0) close(fd);
+    fprintf(stderr, "Failed to open map %s.\n", path);
+    return EXIT_FAILURE;
+  }
+
+  void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s.\n", path);
+    return EXIT_FAILURE;
+  }
+
+  if (load_map_image(mapping, file_stat.st_size) == EXIT_FAILURE) {
+    munmap(mapping, file_stat.st_size);
+    fprintf(stderr, "%s is not a valid version %d map.\n", path, MAP_VERSION);
+    return EXIT_FAILURE;
+  }
+
+  app.map.mapping = mapping;
+  return 0;
+}
+
+void unload_map() {
+  if (app.map.mapping) munmap(app.map.mapping, app.map.image_size);
+  if (app.map.buffer) free(app.map.buffer);
+  free(app.map.walls);
+  memset(&app.map, 0, sizeof(Map));
+}
+
+//Compile a text map, '#' is a wall & 'S' a spawn point, into a map file
+int compile_map(char **argv) {
+  uint8_t tiles[MAP_MAX_HEIGHT * MAP_MAX_WIDTH] = {0};
+  Map_spawn spawns[MAP_MAX_HEIGHT * MAP_MAX_WIDTH];
+  uint16_t width = 0, height = 0, num_of_spawns = 0;
+  char line[MAP_MAX_WIDTH + 3]; //Room for a CRLF & the terminator
+
+  if (!argv[2] || !argv[3]) {
+    fprintf(stderr, "Use the following format:\n"
+                    "%s compile-map <text file> <map file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *in = fopen(argv[2], "r");
+  if (!in) {
+    fprintf(stderr, "Failed to open %s.\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    uint16_t length = strcspn(line, "\r\n");
+
+    if (height == MAP_MAX_HEIGHT || length > MAP_MAX_WIDTH) {
+      fprintf(stderr, "Maps can be at most %dx%d tiles.\n",
+        MAP_MAX_WIDTH, MAP_MAX_HEIGHT);
+      fclose(in);
+      return EXIT_FAILURE;
+    }
+
+    for (uint16_t x = 0; x < length; x++) {
+      if (line[x] == '#') tiles[height * MAP_MAX_WIDTH + x] = 1;
+      if (line[x] == 'S') {
+        Map_spawn spawn = { x * TILE_SIZE, height * TILE_SIZE };
+        spawns[num_of_spawns++] = spawn;
+      }
+    }
+
+    if (length > width) width = length;
+    height++;
+  }
+  fclose(in);
+
+  if (!width || !height) {
+    fprintf(stderr, "%s is empty.\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  //Pack rows to the final width
+  for (uint16_t y = 1; y < height; y++) {
+    memmove(&tiles[y * width], &tiles[y * MAP_MAX_WIDTH], width);
+  }
+
+  uint32_t size;
+  uint8_t *image = build_map_image(tiles, width, height, spawns, num_of_spawns, &size);
+  uint16_t num_of_rects = ((Map_header *)image)->num_of_rects;
+  FILE *out = fopen(argv[3], "wb");
+  int res = out && fwrite(image, size, 1, out) == 1 ? 0 : EXIT_FAILURE;
+
+  if (out) fclose(out);
+  free(image);
+  if (res == EXIT_FAILURE) {
+    fprintf(stderr, "Failed to write %s.\n", argv[3]);
+    return EXIT_FAILURE;
+  }
+
+  printf("Compiled a %dx%d map with %d wall rectangles & %d spawn points.\n",
+    width, height, num_of_rects, num_of_spawns);
+  return 0;
+}
+
 void generate_map() {
- app.map[5][5] = 1;
- app.map[5][6] = 1;
- app.map[5][7] = 1;
- app.map[8][5] = 1;
- app.map[8][6] = 1;
- app.map[8][7] = 1;
- app.map[9][5] = 1;
- app.map[10][5] = 1;
- app.map[11][5] = 1;
- app.map[12][5] = 1;
+  uint8_t tiles[MAP_HEIGHT][MAP_WIDTH] = {0};
+  uint32_t size;
+
+  tiles[5][5] = 1;
+  tiles[5][6] = 1;
+  tiles[5][7] = 1;
+  tiles[8][5] = 1;
+  tiles[8][6] = 1;
+  tiles[8][7] = 1;
+  tiles[9][5] = 1;
+  tiles[10][5] = 1;
+  tiles[11][5] = 1;
+  tiles[12][5] = 1;
+
+  uint8_t *image = build_map_image(&tiles[0][0], MAP_WIDTH, MAP_HEIGHT, NULL, 0, &size);
+  load_map_image(image, size);
+  app.map.buffer = image;
 }
 
 void draw_map() {
-  for (int i = 0; i < MAP_HEIGHT; i++) {
-    for (int j = 0; j < MAP_WIDTH; j++) {
-      if (app.map[i][j] == 0) { continue; }
+  //Draw the merged walls in a single call
+  SDL_SetRenderDrawColor(app.renderer, 0, 0, 255, 255);
+  SDL_RenderDrawRects(app.renderer, app.map.walls, app.map.num_of_rects);
+}
+
+/* Broadphase logic */
+Grid_range get_grid_range(SDL_Rect *rect) {
+  Grid_range range;
+
+  //Anything outside of the map falls into the border cells
+  range.x0 = rect->x < 0 ? 0 : rect->x / GRID_CELL_SIZE;
+  range.y0 = rect->y < 0 ? 0 : rect->y / GRID_CELL_SIZE;
+  range.x1 = rect->x + rect->w < 0 ? 0 : (rect->x + rect->w) / GRID_CELL_SIZE;
+  range.y1 = rect->y + rect->h < 0 ? 0 : (rect->y + rect->h) / GRID_CELL_SIZE;
+  if (range.x0 >= GRID_WIDTH) range.x0 = GRID_WIDTH - 1;
+  if (range.y0 >= GRID_HEIGHT) range.y0 = GRID_HEIGHT - 1;
+  if (range.x1 >= GRID_WIDTH) range.x1 = GRID_WIDTH - 1;
+  if (range.y1 >= GRID_HEIGHT) range.y1 = GRID_HEIGHT - 1;
+
+  return range;
+}
+
+//Bounds covering every position a hit test might check the player at
+void get_player_bounds(Player *p, SDL_Rect *bounds) {
+  int16_t min_x = FIXED_TO_INT(p->pos_x), max_x = min_x;
+  int16_t min_y = FIXED_TO_INT(p->pos_y), max_y = min_y;
+
+  //On the host this includes the positions within the rewind window
+  if (app.server) {
+    uint32_t oldest = SDL_GetTicks() - app.rewind_cap;
+    Position_history *history = &p->history;
+
+    for (int i = 1; i <= history->size; i++) {
+      int index = (history->back - i + HISTORY_SIZE) % HISTORY_SIZE;
+      Position_record *record = &history->records[index];
+      int16_t pos_x = FIXED_TO_INT(record->pos_x);
+      int16_t pos_y = FIXED_TO_INT(record->pos_y);
+
+      if (pos_x < min_x) min_x = pos_x;
+      if (pos_x > max_x) max_x = pos_x;
+      if (pos_y < min_y) min_y = pos_y;
+      if (pos_y > max_y) max_y = pos_y;
+      if ((int32_t)(oldest - record->time) >= 0) break;
+    }
+  }
+
+  bounds->x = min_x;
+  bounds->y = min_y;
+  bounds->w = max_x - min_x + PLAYER_SIZE;
+  bounds->h = max_y - min_y + PLAYER_SIZE;
+}
+
+void grid_remove_player(uint8_t index) {
+  Player *p = &app.players[index];
+  if (!p->in_grid) return;
+
+  for (int y = p->grid_range.y0; y <= p->grid_range.y1; y++) {
+    for (int x = p->grid_range.x0; x <= p->grid_range.x1; x++) {
+      Grid_cell *cell = &app.grid.cells[y][x];
+
+      for (uint8_t i = 0; i < cell->count; i++) {
+        if (cell->players[i] != index) continue;
+
+        cell->players[i] = cell->players[--cell->count]; //Swap remove
+        break;
+      }
+    }
+  }
+
+  p->in_grid = 0;
+}
 
-      uint16_t pos_x = j * TILE_SIZE;
-      uint16_t pos_y = i * TILE_SIZE;
+void grid_insert_player(uint8_t index, Grid_range range) {
+  Player *p = &app.players[index];
 
-      //Draw rectangle
-      SDL_Rect rect = {pos_x, pos_y, TILE_SIZE, TILE_SIZE};
-      SDL_SetRenderDrawColor(app.renderer, 0, 0, 255, 255);
-      SDL_RenderDrawRect(app.renderer, &rect);
+  for (int y = range.y0; y <= range.y1; y++) {
+    for (int x = range.x0; x <= range.x1; x++) {
+      Grid_cell *cell = &app.grid.cells[y][x];
+      cell->players[cell->count++] = index;
     }
   }
+
+  p->grid_range = range;
+  p->in_grid = 1;
+}
+
+//Move a player to the cells covering its bounds, if they changed
+void grid_update_player(Player *p) {
+  uint8_t index = p - app.players;
+  SDL_Rect bounds;
+
+  get_player_bounds(p, &bounds);
+  Grid_range range = get_grid_range(&bounds);
+
+  if (p->in_grid && memcmp(&range, &p->grid_range, sizeof(Grid_range)) == 0)
+    return;
+
+  grid_remove_player(index);
+  grid_insert_player(index, range);
+}
+
+//Rebuild the grid from scratch, needed when player indexes change
+void grid_rebuild() {
+  memset(app.grid.cells, 0, sizeof(app.grid.cells));
+
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    app.players[i].in_grid = 0;
+    grid_update_player(&app.players[i]);
+  }
+}
+
+//Collect the indexes of all players whose cells overlap a rectangle
+uint8_t grid_query(SDL_Rect *rect, uint8_t *players) {
+  Grid_range range = get_grid_range(rect);
+  uint8_t count = 0;
+
+  app.grid.stamp++; //Invalidate the visited marks of the previous query
+  for (int y = range.y0; y <= range.y1; y++) {
+    for (int x = range.x0; x <= range.x1; x++) {
+      Grid_cell *cell = &app.grid.cells[y][x];
+
+      for (uint8_t i = 0; i < cell->count; i++) {
+        uint8_t index = cell->players[i];
+        if (app.grid.visited[index] == app.grid.stamp) continue;
+
+        app.grid.visited[index] = app.grid.stamp;
+        players[count++] = index;
+      }
+    }
+  }
+
+  return count;
 }
 
 /* Player logic */
-int create_player(Player *player, uint8_t id, uint16_t pos_x, uint16_t pos_y) {
+//Pick a random spawn point of the map that no tank is standing on
+uint8_t pick_spawn_point(uint16_t *pos_x, uint16_t *pos_y) {
+  if (!app.map.num_of_spawns) return 0;
+  uint16_t first = rand() % app.map.num_of_spawns;
+
+  for (uint16_t i = 0; i < app.map.num_of_spawns; i++) {
+    const Map_spawn *spawn = &app.map.spawns[(first + i) % app.map.num_of_spawns];
+    SDL_Rect rect = {spawn->x, spawn->y, PLAYER_SIZE, PLAYER_SIZE};
+    uint8_t nearby[MAX_PLAYERS];
+    uint8_t occupied = 0;
+    uint8_t num_of_nearby = grid_query(&rect, nearby);
+
+    for (uint8_t n = 0; n < num_of_nearby; n++) {
+      Player *other = &app.players[nearby[n]];
+      SDL_Rect rect_other = {FIXED_TO_INT(other->pos_x), FIXED_TO_INT(other->pos_y),
+                             PLAYER_SIZE, PLAYER_SIZE};
+      if (SDL_HasIntersection(&rect, &rect_other) == SDL_TRUE) occupied = 1;
+    }
+    if (occupied) continue;
+
+    *pos_x = spawn->x;
+    *pos_y = spawn->y;
+    return 1;
+  }
+
+  return 0;
+}
+
+//Where a new tank starts, anywhere on maps without a free spawn point
+void pick_start_position(uint16_t *pos_x, uint16_t *pos_y) {
   srand(time(NULL)); //Seed the random generator
-  if (!pos_x) pos_x = rand() % 631 + 10;
-  if (!pos_y) pos_y = rand() % 471 + 10;
+  if (pick_spawn_point(pos_x, pos_y)) return;
 
+  *pos_x = rand() % 631 + 10;
+  *pos_y = rand() % 471 + 10;
+}
+
+int create_player(Player *player, uint8_t id, uint16_t pos_x, uint16_t pos_y) {
   //Create player
   memset(player, 0, sizeof(Player));
   player->id = id;
-  player->pos_x = pos_x;
-  player->pos_y = pos_y;
+  player->pos_x = INT_TO_FIXED(pos_x);
+  player->pos_y = INT_TO_FIXED(pos_y);
+  player->prev_pos_x = player->pos_x;
+  player->prev_pos_y = player->pos_y;
   player->angle = 0;
   player->bullet_queue.size = 0;
 
-  //Load texture for player
-  player->texture = loadTexture("tank.png");
-  if (!player->texture) {
-    fprintf(stderr, "Failed to load player texture: %s\n", SDL_GetError());
-    return EXIT_FAILURE;
-  }
-
   app.num_of_players++; //Increase number of players
-  app.current_id++; //Increase current id
+  grid_update_player(player);
 
   return 0;
 }
 
 int delete_player(uint8_t *id) {
-  uint8_t local_player_id = app.local_player->id;
+  uint8_t local_player_id = app.local_player ? app.local_player->id : 0;
 
   for (uint8_t i = 0; i < app.num_of_players; i++) {
     if (app.players[i].id == *id) {
@@ -820,10 +4022,10 @@ int delete_player(uint8_t *id) {
       }
 
       app.num_of_players--; //Decrement number of players
+      grid_rebuild(); //Player indexes shifted
 
       //Update local player pointer
-      Player *local_player = get_player_by_id(local_player_id);
-      app.local_player = local_player;
+      if (app.local_player) app.local_player = get_player_by_id(local_player_id);
       return 0;
     }
   }
@@ -844,74 +4046,88 @@ Player *get_player_by_id(uint8_t id) {
   return NULL;
 }
 
-uint8_t player_collided(Player *p, uint16_t *pos_x_tank, uint16_t *pos_y_tank) {
-  //Check map collisions
-  for (int i = 0; i < MAP_HEIGHT; i++) {
-    for (int j = 0; j < MAP_WIDTH; j++) {
-      if (app.map[i][j] == 0) { continue; }
+//Lowest id nobody plays as, ids of players that left are handed out again
+uint8_t free_player_id() {
+  if (app.num_of_players == MAX_PLAYERS) return SPECTATOR_ID;
 
-      //Create wall rectangle
-      uint16_t pos_x_wall = j * TILE_SIZE;
-      uint16_t pos_y_wall = i * TILE_SIZE;
-      SDL_Rect rect_wall = {pos_x_wall, pos_y_wall, TILE_SIZE, TILE_SIZE};
+  for (uint8_t id = 0; id < SPECTATOR_ID; id++) {
+    if (!get_player_by_id(id)) return id;
+  }
+
+  return SPECTATOR_ID; //Never a player
+}
 
-      //Create tank rectangle
-      SDL_Rect rect_tank = {*pos_x_tank, *pos_y_tank, PLAYER_SIZE, PLAYER_SIZE};
+uint8_t player_collided(Player *p, fixed pos_x_tank, fixed pos_y_tank) {
+  //Create tank rectangle
+  SDL_Rect rect_tank = {FIXED_TO_INT(pos_x_tank), FIXED_TO_INT(pos_y_tank),
+                        PLAYER_SIZE, PLAYER_SIZE};
 
-      if (SDL_HasIntersection(&rect_wall, &rect_tank) == SDL_TRUE) { return 1; }
+  //Check map collisions
+  if (!map_area_is_free(&rect_tank)) {
+    for (uint16_t i = 0; i < app.map.num_of_rects; i++) {
+      if (SDL_HasIntersection(&app.map.walls[i], &rect_tank) == SDL_TRUE) { return 1; }
     }
   }
 
-  //Check other player collisions
-  for (int i = 0; i < app.num_of_players; i++) {
-    if (p->id == app.players[i].id) { continue; } //Ignore self
+  //Check collisions with the players in nearby cells
+  uint8_t nearby[MAX_PLAYERS];
+  uint8_t num_of_nearby = grid_query(&rect_tank, nearby);
+
+  for (uint8_t n = 0; n < num_of_nearby; n++) {
+    Player *other = &app.players[nearby[n]];
+    if (p->id == other->id) { continue; } //Ignore self
 
     //Create other player rectangle
-    uint16_t pos_x_other = app.players[i].pos_x;
-    uint16_t pos_y_other = app.players[i].pos_y;
+    int pos_x_other = FIXED_TO_INT(other->pos_x);
+    int pos_y_other = FIXED_TO_INT(other->pos_y);
     SDL_Rect rect_other = {pos_x_other, pos_y_other, PLAYER_SIZE, PLAYER_SIZE};
 
-    //Create tank rectangle
-    SDL_Rect rect_tank = {*pos_x_tank, *pos_y_tank, PLAYER_SIZE, PLAYER_SIZE};
-
     if (SDL_HasIntersection(&rect_other, &rect_tank) == SDL_TRUE) { return 1; }
   }
 
   return 0;
 }
 
-void drawPlayer(Player *p) {
-  //Round positions to int
-  int pos_x = (int)floor(p->pos_x);
-  int pos_y = (int)floor(p->pos_y);
+//Draw the player between its last two ticks or snapshots, alpha is the blend in [0, 1]
+void drawPlayer(Player *p, float alpha) {
+  float pos_x = FIXED_TO_FLOAT(p->prev_pos_x) + FIXED_TO_FLOAT(p->pos_x - p->prev_pos_x) * alpha;
+  float pos_y = FIXED_TO_FLOAT(p->prev_pos_y) + FIXED_TO_FLOAT(p->pos_y - p->prev_pos_y) * alpha;
+
+  //Turn the short way round
+  float turn = fmodf(FIXED_TO_FLOAT(p->angle - p->prev_angle) + 900, 360) - 180;
 
-  blit(p->texture, pos_x, pos_y, p->angle);
+  sprite_batch_add(&app.tanks, pos_x, pos_y, FIXED_TO_FLOAT(p->prev_angle) + turn * alpha);
 }
 
 void movePlayerForward(Player *p) {
-  float new_pos_xf = p->pos_x + sin(p->angle * PI/180) * PLAYER_SPEED;
-  float new_pos_yf = p->pos_y - cos(p->angle * PI/180) * PLAYER_SPEED;
-  uint16_t new_pos_xi = (uint16_t)new_pos_xf;
-  uint16_t new_pos_yi = (uint16_t)new_pos_yf;
+  fixed speed = scale_speed(PLAYER_SPEED);
+  fixed new_pos_x = p->pos_x + fixed_mul(fixed_sin(FIXED_ROUND(p->angle)), speed);
+  fixed new_pos_y = p->pos_y - fixed_mul(fixed_cos(FIXED_ROUND(p->angle)), speed);
 
-  if(player_collided(p, &new_pos_xi, &new_pos_yi)) { return; }
+  if(player_collided(p, new_pos_x, new_pos_y)) { return; }
 
   //Move player
-  p->pos_x = new_pos_xf;
-  p->pos_y = new_pos_yf;
+  p->pos_x = new_pos_x;
+  p->pos_y = new_pos_y;
+  grid_update_player(p);
 }
 
 void movePlayerBackward(Player *p) {
-  float new_pos_xf = p->pos_x - sin(p->angle * PI/180) * PLAYER_SPEED;
-  float new_pos_yf = p->pos_y + cos(p->angle * PI/180) * PLAYER_SPEED;
-  uint16_t new_pos_xi = (uint16_t)new_pos_xf;
-  uint16_t new_pos_yi = (uint16_t)new_pos_yf;
+  fixed speed = scale_speed(PLAYER_SPEED);
+  fixed new_pos_x = p->pos_x - fixed_mul(fixed_sin(FIXED_ROUND(p->angle)), speed);
+  fixed new_pos_y = p->pos_y + fixed_mul(fixed_cos(FIXED_ROUND(p->angle)), speed);
 
-  if(player_collided(p, &new_pos_xi, &new_pos_yi)) { return; }
+  if(player_collided(p, new_pos_x, new_pos_y)) { return; }
 
   //Move player
-  p->pos_x = new_pos_xf;
-  p->pos_y = new_pos_yf;
+  p->pos_x = new_pos_x;
+  p->pos_y = new_pos_y;
+  grid_update_player(p);
+}
+
+//Turn left with -1 & right with 1
+void turnPlayer(Player *p, int direction) {
+  p->angle = (p->angle + direction * scale_speed(PLAYER_ROTATION_SPEED)) % INT_TO_FIXED(360);
 }
 
 /* Bullet logic */
@@ -939,130 +4155,148 @@ void bullet_enqueue(Bullet_queue *bullet_queue, Bullet *bullet) {
   if (bullet_queue->size < BULLET_AMOUNT) { bullet_queue->size++; }
 }
 
+//Bullets live for a fixed number of ticks, the same on every machine
 uint8_t bullet_timed_out(Bullet *bullet) {
-  struct timeval now;
-  uint32_t time_created_full, time_now_full;
-
-  gettimeofday(&now, NULL);
-
-  //Combine seconds & microseconds for a precise result
-  //(microseconds loop otherwise)
-  time_created_full = bullet->time_created.tv_sec * 1000000;
-  time_created_full += bullet->time_created.tv_usec;
-
-  time_now_full = now.tv_sec * 1000000 + now.tv_usec;
-
-  if ((time_now_full - time_created_full) / 1000000 >= BULLET_TIMEOUT) return 1;
+  if (bullet->ticks >= BULLET_TIMEOUT * app.tick_rate) return 1;
   return 0;
 }
 
-void shoot_bullet(Player *p, uint16_t pos_x, uint16_t pos_y, int16_t angle) {
-  //Get player width & height
-  int p_width, p_height;
-  SDL_QueryTexture(p->texture, NULL, NULL, &p_width, &p_height);
+//Fire a bullet from the center of the player's tank
+void shoot_bullet(Player *p) {
+  fixed offset = INT_TO_FIXED(PLAYER_SIZE / 2 - (BULLET_SIZE / 2 - 1));
+  fixed pos_x = p->pos_x + offset;
+  fixed pos_y = p->pos_y + offset;
+
+  spawn_bullet(p, pos_x, pos_y, FIXED_ROUND(p->angle));
+}
 
+void spawn_bullet(Player *p, fixed pos_x, fixed pos_y, int16_t angle) {
   //Create bullet
   Bullet bullet = {0};
-  if (!pos_x) pos_x = (uint16_t)p->pos_x + p_width / 2 - (BULLET_SIZE / 2 - 1);
-  if (!pos_y) pos_y = (uint16_t)p->pos_y + p_height / 2 - (BULLET_SIZE / 2 - 1);
-  if (!angle) angle = p->angle;
-
   bullet.pos_x = pos_x;
   bullet.pos_y = pos_y;
+  bullet.prev_pos_x = pos_x;
+  bullet.prev_pos_y = pos_y;
   bullet.angle = angle;
 
-  gettimeofday(&bullet.time_created, NULL);
   bullet_enqueue(&p->bullet_queue, &bullet);
 
-  //Broadcast to clients if server
-  if (app.server) send_enet_host_new_bullet(p, &bullet);
+  //Queue for the clients if server
+  if (app.server) queue_event_new_bullet(p, &bullet);
 }
 
-Player *bullet_collided(Player *p, float *pos_x_bullet, float *pos_y_bullet) {
-  //Check other player collisions
-  for (int i = 0; i < app.num_of_players; i++) {
-    if (p->id == app.players[i].id) continue; //Ignore self
+void update_player_latencies() {
+  for (size_t i = 0; i < app.server->peerCount; i++) {
+    ENetPeer *peer = &app.server->peers[i];
+    if (peer->state != ENET_PEER_STATE_CONNECTED || !peer->data) continue;
+
+    Player *player = get_player_by_id(*(uint8_t *)peer->data);
+    if (player) player->latency = peer->roundTripTime;
+  }
+}
+
+void record_player_positions() {
+  uint32_t now = SDL_GetTicks();
+
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    Position_history *history = &app.players[i].history;
+    Position_record record = { now, app.players[i].pos_x, app.players[i].pos_y };
+
+    history->records[history->back] = record;
+    history->back = (history->back + 1) % HISTORY_SIZE;
+    if (history->size < HISTORY_SIZE) { history->size++; }
+  }
+}
+
+//Get the position a player had at a given time, or the oldest one recorded
+void get_player_position_at(Player *p, uint32_t time, fixed *pos_x, fixed *pos_y) {
+  Position_history *history = &p->history;
+
+  *pos_x = p->pos_x;
+  *pos_y = p->pos_y;
+
+  //Walk back from the newest record until one is old enough
+  for (int i = 1; i <= history->size; i++) {
+    int index = (history->back - i + HISTORY_SIZE) % HISTORY_SIZE;
+    Position_record *record = &history->records[index];
+
+    *pos_x = record->pos_x;
+    *pos_y = record->pos_y;
+    if ((int32_t)(time - record->time) >= 0) return;
+  }
+}
+
+Player *bullet_collided(Player *p, fixed pos_x_bullet, fixed pos_y_bullet) {
+  //The host rewinds other players to what the shooter saw
+  uint32_t rewind = 0;
+  if (app.server) rewind = p->latency < app.rewind_cap ? p->latency : app.rewind_cap;
+  uint32_t view_time = SDL_GetTicks() - rewind;
+
+  //Create bullet rectangle
+  SDL_Rect rect_bullet = {FIXED_TO_INT(pos_x_bullet), FIXED_TO_INT(pos_y_bullet),
+                          BULLET_SIZE, BULLET_SIZE};
+
+  //Check collisions with the players in nearby cells
+  uint8_t nearby[MAX_PLAYERS];
+  uint8_t num_of_nearby = grid_query(&rect_bullet, nearby);
+
+  for (uint8_t n = 0; n < num_of_nearby; n++) {
+    Player *other = &app.players[nearby[n]];
+    if (p->id == other->id) continue; //Ignore self
 
     //Create other player rectangle
-    uint16_t pos_x_other = app.players[i].pos_x;
-    uint16_t pos_y_other = app.players[i].pos_y;
+    fixed pos_x_view, pos_y_view;
+    get_player_position_at(other, view_time, &pos_x_view, &pos_y_view);
+    int pos_x_other = FIXED_TO_INT(pos_x_view);
+    int pos_y_other = FIXED_TO_INT(pos_y_view);
     SDL_Rect rect_other = {pos_x_other, pos_y_other, PLAYER_SIZE, PLAYER_SIZE};
 
-    //Create tank rectangle
-    SDL_Rect rect_bullet = {(uint16_t)*pos_x_bullet, (uint16_t)*pos_y_bullet,
-                            BULLET_SIZE, BULLET_SIZE};
-
     if (SDL_HasIntersection(&rect_other, &rect_bullet) == SDL_TRUE)
-      return &app.players[i];
+      return other;
   }
 
   return NULL;
 }
 
-void update_bullet_angle(Bullet *b, float *pos_x_bullet, float *pos_y_bullet,
-                         SDL_Rect *rect_wall, uint16_t i, uint16_t j) {
-  /* The bullet can either bounce on the x or y plane.
-   * What we check is if bouncing on the x plane (360 - b->angle)
-   * would result in a new collision. If it would, we instead
-   * bounce on the y plane (180 - b->angle).
-   *
-   * We also need to check if the new position would collide with
-   * the block to the right of the current one. This is due to
-   * the collision check going from left to right and top to
-   * bottom. A corner collision with a rectangle might result in an
-   * x plane bounce but there might actually be a rectangle to
-   * the right of it, meaning a y plane bounce is the correct
-   * choice.
+uint8_t bullet_bounce(Bullet *b, fixed pos_x_bullet, fixed pos_y_bullet) {
+  /* The side of a wall the bullet came through decides the plane it
+   * bounces on. If the bullet was already level with the wall on the
+   * x axis it came from above or below, so it bounces on the y plane
+   * (180 - b->angle). If it was level on the y axis it bounces on the
+   * x plane (360 - b->angle). Walls are merged rectangles, so there
+   * are no seams between tiles and every wall the bullet touches in
+   * a concave corner gets to flip its own plane. Hitting nothing but
+   * a convex corner sends the bullet straight back.
    */
-  uint16_t new_angle = 360 - b->angle;
-  float new_pos_x = *pos_x_bullet + sin(new_angle * PI/180) * BULLET_SPEED;
-  float new_pos_y = *pos_y_bullet - cos(new_angle * PI/180) * BULLET_SPEED;
+  uint8_t flip_x = 0, flip_y = 0, corner = 0;
 
-  //Create new bullet rectangle
-  SDL_Rect new_rect_bullet = {(uint16_t)new_pos_x, (uint16_t)new_pos_y,
+  //Create current & new bullet rectangles
+  SDL_Rect rect_bullet = {FIXED_TO_INT(b->pos_x), FIXED_TO_INT(b->pos_y),
+                          BULLET_SIZE, BULLET_SIZE};
+  SDL_Rect new_rect_bullet = {FIXED_TO_INT(pos_x_bullet), FIXED_TO_INT(pos_y_bullet),
                               BULLET_SIZE, BULLET_SIZE};
-  if (SDL_HasIntersection(rect_wall, &new_rect_bullet) == SDL_TRUE) {
-    b->angle = 180 - b->angle;
-  }
-  else { //Check if there is a collision with a block to the right
-    if (j + 1 < MAP_WIDTH && app.map[i][j + 1] == 1) {
-      uint16_t pos_x_wall_right = (j + 1) * TILE_SIZE;
-      uint16_t pos_y_wall_right = i * TILE_SIZE;
-      SDL_Rect rect_wall_right = {pos_x_wall_right, pos_y_wall_right,
-                                  TILE_SIZE, TILE_SIZE};
-
-      if (SDL_HasIntersection(&rect_wall_right, &new_rect_bullet) == SDL_TRUE) {
-        b->angle = 180 - b->angle;
-      }
-    }
-    else {
-      b->angle = 360 - b->angle;
-    }
-  }
-}
+  if (map_area_is_free(&new_rect_bullet)) return 0;
 
-void bullet_bounce(Bullet *b, float *pos_x_bullet, float *pos_y_bullet) {
   //Check map collisions
-  for (uint16_t i = 0; i < MAP_HEIGHT; i++) {
-    for (uint16_t j = 0; j < MAP_WIDTH; j++) {
-      if (app.map[i][j] == 0) { continue; }
-
-      //Create wall rectangle
-      uint16_t pos_x_wall = j * TILE_SIZE;
-      uint16_t pos_y_wall = i * TILE_SIZE;
-      SDL_Rect rect_wall = {pos_x_wall, pos_y_wall, TILE_SIZE, TILE_SIZE};
-
-      //Create bullet rectangle
-      SDL_Rect rect_bullet = {(uint16_t)*pos_x_bullet,
-                              (uint16_t) *pos_y_bullet,
-                              BULLET_SIZE, BULLET_SIZE};
-
-      if (SDL_HasIntersection(&rect_wall, &rect_bullet) == SDL_TRUE) {
-        update_bullet_angle(b, pos_x_bullet, pos_y_bullet, &rect_wall, i, j);
-        return;
-      }
-    }
+  for (uint16_t i = 0; i < app.map.num_of_rects; i++) {
+    SDL_Rect *wall = &app.map.walls[i];
+    if (SDL_HasIntersection(wall, &new_rect_bullet) == SDL_FALSE) continue;
+
+    uint8_t level_x = rect_bullet.x < wall->x + wall->w &&
+                      wall->x < rect_bullet.x + rect_bullet.w;
+    uint8_t level_y = rect_bullet.y < wall->y + wall->h &&
+                      wall->y < rect_bullet.y + rect_bullet.h;
+
+    if (level_x) flip_y = 1;
+    if (level_y) flip_x = 1;
+    if (!level_x && !level_y) corner = 1;
   }
+
+  if (corner && !flip_x && !flip_y) flip_x = flip_y = 1;
+  if (flip_x) b->angle = 360 - b->angle;
+  if (flip_y) b->angle = 180 - b->angle;
+
+  return flip_x || flip_y;
 }
 
 void update_bullet_positions(Player *p) {
@@ -1071,24 +4305,26 @@ void update_bullet_positions(Player *p) {
     Bullet *b = &p->bullet_queue.bullets[index];
 
     //Delete bullet if it timed out
+    b->ticks++;
     if (bullet_timed_out(b)) {
       bullet_dequeue(&p->bullet_queue, b);
       continue;
     }
 
-    float new_pos_x = b->pos_x + sin(b->angle * PI/180) * BULLET_SPEED;
-    float new_pos_y = b->pos_y - cos(b->angle * PI/180) * BULLET_SPEED;
+    fixed speed = scale_speed(BULLET_SPEED);
+    fixed new_pos_x = b->pos_x + fixed_mul(fixed_sin(b->angle), speed);
+    fixed new_pos_y = b->pos_y - fixed_mul(fixed_cos(b->angle), speed);
 
     //Check if bullet hit a player
-    Player *player_hit = bullet_collided(p, &new_pos_x, &new_pos_y);
+    Player *player_hit = bullet_collided(p, new_pos_x, new_pos_y);
     if (player_hit) {
-      if (app.server) { send_enet_host_player_hit(player_hit, p); }
+      if (app.server) { queue_event_player_hit(player_hit, p); }
       bullet_dequeue(&p->bullet_queue, b);
       continue;
     }
 
-    //Change angle of bullet if it hit a wall
-    bullet_bounce(b, &new_pos_x, &new_pos_y);
+    //Change angle of bullet if it hit a wall, it stays put for this tick
+    if (bullet_bounce(b, new_pos_x, new_pos_y)) continue;
 
     //Move bullet
     b->pos_x = new_pos_x;
@@ -1096,26 +4332,31 @@ void update_bullet_positions(Player *p) {
   }
 }
 
-void drawBullets(Player *player) {
+void drawBullets(Player *player, float alpha) {
   for (int i = 0; i < player->bullet_queue.size; i++) {
     uint8_t index = (player->bullet_queue.front + i) % BULLET_AMOUNT;
+    Bullet *b = &player->bullet_queue.bullets[index];
 
-    //Round positions to int
-    uint16_t pos_x = player->bullet_queue.bullets[index].pos_x;
-    uint16_t pos_y = player->bullet_queue.bullets[index].pos_y;
+    //Blend between the last two ticks
+    float pos_x = FIXED_TO_FLOAT(b->prev_pos_x) + FIXED_TO_FLOAT(b->pos_x - b->prev_pos_x) * alpha;
+    float pos_y = FIXED_TO_FLOAT(b->prev_pos_y) + FIXED_TO_FLOAT(b->pos_y - b->prev_pos_y) * alpha;
 
-    //Draw rectangle
-    SDL_Rect rect = {pos_x, pos_y, BULLET_SIZE, BULLET_SIZE};
-    SDL_SetRenderDrawColor(app.renderer, 220, 0, 0, 255);
-    SDL_RenderDrawRect(app.renderer, &rect);
+    //Queue rectangle, all bullets are drawn together
+    SDL_FRect rect = {pos_x, pos_y, BULLET_SIZE, BULLET_SIZE};
+    app.bullet_rects[app.num_of_bullet_rects++] = rect;
   }
 }
 
 /* Game loop logic */
 uint8_t load() {
   if (app.server) {
-    generate_map();
-    uint8_t res = create_player(&app.players[0], 0, 0, 0);
+    if (!app.map_path) { generate_map(); }
+    else if (load_map_file(app.map_path) == EXIT_FAILURE) { return EXIT_FAILURE; }
+    if (app.headless) return 0; //No local player
+
+    uint16_t pos_x, pos_y;
+    pick_start_position(&pos_x, &pos_y);
+    uint8_t res = create_player(&app.players[0], 0, pos_x, pos_y);
     if (res == EXIT_FAILURE) return EXIT_FAILURE;
 
     app.local_player = &app.players[0]; //Create a pointer to the local player
@@ -1124,59 +4365,183 @@ uint8_t load() {
   return 0;
 }
 
-void update() {
-  if (!app.num_of_players) { return; } //Skip if no players
-  int16_t *angle = &(app.local_player->angle);
+void update_local_player() {
+  if (!app.local_player) { return; } //Headless hosts have no local player
 
   if (app.up) movePlayerForward(app.local_player);
   if (app.down) movePlayerBackward(app.local_player);
-  if (app.left) *angle = (*angle - PLAYER_ROTATION_SPEED) % 360;
-  if (app.right) *angle = (*angle + PLAYER_ROTATION_SPEED) % 360;
+  if (app.left) turnPlayer(app.local_player, -1);
+  if (app.right) turnPlayer(app.local_player, 1);
   if (app.button_a && !app.button_a_is_down) {
-    shoot_bullet(app.local_player, 0, 0, 0);
+    shoot_bullet(app.local_player);
     app.button_a_is_down = 1;
   }
+}
+
+void update() {
+  if (!app.num_of_players) { return; } //Skip if no players
+  update_local_player();
+
+  if (app.server) {
+    update_player_latencies();
+    record_player_positions();
+
+    //The rewind window moved, so did the player bounds
+    for (uint8_t i = 0; i < app.num_of_players; i++) {
+      grid_update_player(&app.players[i]);
+    }
+  }
 
   for (uint8_t i = 0; i < app.num_of_players; i++) {
     update_bullet_positions(&app.players[i]);
   }
 }
 
+//How far into the current tick we are, the scene lags a tick behind
+float get_tick_alpha() {
+  uint64_t tick_ns = tick_length();
+  uint64_t last_tick = app.next_tick - tick_ns;
+  uint64_t now = get_time_ns();
+
+  if (!tick_ns) return 1;
+  if (now <= last_tick) return 0;
+  if (now - last_tick >= tick_ns) return 1;
+  return (float)(now - last_tick) / tick_ns;
+}
+
+//How far a remote tank is from its previous snapshot to the latest
+float get_snapshot_alpha(Player *p) {
+  uint64_t elapsed = get_time_ns() - p->snapshot_time;
+
+  if (elapsed >= p->snapshot_interval) return 1;
+  return (float)elapsed / p->snapshot_interval;
+}
+
+//Restart a remote tank's blend at the pose it's drawn at right now
+void blend_previous_snapshot(Player *p) {
+  float alpha = get_snapshot_alpha(p);
+  fixed full_turn = INT_TO_FIXED(360);
+  fixed turn = ((p->angle - p->prev_angle) % full_turn + INT_TO_FIXED(540)) % full_turn -
+               INT_TO_FIXED(180); //The short way round
+
+  p->prev_pos_x += (fixed)((p->pos_x - p->prev_pos_x) * alpha);
+  p->prev_pos_y += (fixed)((p->pos_y - p->prev_pos_y) * alpha);
+  p->prev_angle = (p->prev_angle + (fixed)(turn * alpha)) % full_turn;
+}
+
 void draw() {
-  if (!app.num_of_players) { return; } //Skip if no players
+  float alpha = get_tick_alpha();
 
-  //Draw background
+  //Draw background, the map & players show up once the host welcomed us
   SDL_SetRenderDrawColor(app.renderer, 25, 25, 25, 255);
   SDL_RenderClear(app.renderer);
 
   draw_map(); //Draw map
 
+  //Draw by layer, one call for all tanks & one for all bullets
   for (int i = 0; i < app.num_of_players; i++) {
-    drawPlayer(&app.players[i]); //Draw player
-    drawBullets(&app.players[i]); //Draw bullets
+    Player *p = &app.players[i];
+    drawPlayer(p, p->snapshot_interval ? get_snapshot_alpha(p) : alpha);
+    drawBullets(p, alpha);
   }
+  sprite_batch_draw(&app.tanks);
+
+  SDL_SetRenderDrawColor(app.renderer, 220, 0, 0, 255);
+  SDL_RenderDrawRectsF(app.renderer, app.bullet_rects, app.num_of_bullet_rects);
+  app.num_of_bullet_rects = 0;
 
   //Present
   SDL_RenderPresent(app.renderer);
-  SDL_Delay(16);
+}
+
+//Keep where everything was before the tick, the renderer blends from there
+void store_previous_state() {
+  for (uint8_t i = 0; i < app.num_of_players; i++) {
+    Player *p = &app.players[i];
+    if (!p->snapshot_interval) { //Remote tanks keep their previous snapshot
+      p->prev_pos_x = p->pos_x;
+      p->prev_pos_y = p->pos_y;
+      p->prev_angle = p->angle;
+    }
+
+    for (int j = 0; j < p->bullet_queue.size; j++) {
+      Bullet *b = &p->bullet_queue.bullets[(p->bullet_queue.front + j) % BULLET_AMOUNT];
+      b->prev_pos_x = b->pos_x;
+      b->prev_pos_y = b->pos_y;
+    }
+  }
+}
+
+void tick() {
+  uint64_t start = get_time_ns();
+
+  store_previous_state();
+  poll_enet();
+  update();
+  if (app.replay.data) replay_tick();
+  send_enet();
+  if (app.recorder.file) record_tick();
+
+  if (app.server) {
+    uint64_t end = get_time_ns();
+    uint64_t busy = end - start;
+
+    //Dedicated hosts handle input while waiting for the tick, count all but the waiting
+    if (app.headless && app.last_tick_end) busy = end - app.last_tick_end - app.blocked_ns;
+    app.last_tick_end = end;
+    app.blocked_ns = 0;
+    watch_tick_budget(busy);
+  }
+}
+
+//Run every tick that is due, the simulation doesn't follow the frame rate
+void run_due_ticks() {
+  for (int i = 0; i < MAX_CATCHUP_TICKS && get_time_ns() >= app.next_tick; i++) {
+    tick();
+    schedule_next_tick();
+  }
 }
 
 int main(int argc, char **argv) {
   app.is_running = 1;
+  app.rewind_cap = REWIND_CAP;
+  app.peer_budget = PEER_BUDGET;
+  app.tick_rate = TICK_RATE;
+  app.fps_cap = -1;
+  app.speed = 1;
   atexit(cleanup); //Assign a cleanup function
+  if (parse_options(argc, argv) == EXIT_FAILURE) return EXIT_FAILURE;
+  if (argv[1] && strcmp(argv[1], "compile-map") == 0) return compile_map(argv);
+  if (argv[1] && strcmp(argv[1], "bench-compress") == 0) return bench_compress(argv);
+  if (argv[1] && strcmp(argv[1], "relay") == 0) app.relay = app.headless = 1; //Never renders
   if (init_SDL() == EXIT_FAILURE) return EXIT_FAILURE; //Initialize SDL
   if (init_enet() == EXIT_FAILURE) return EXIT_FAILURE; //Initialize ENet
 
   if (host_or_join(argv) == EXIT_FAILURE) return EXIT_FAILURE; //Host or join
+  if (init_stats() == EXIT_FAILURE) return EXIT_FAILURE; //Open telemetry
+  if (init_capture() == EXIT_FAILURE) return EXIT_FAILURE; //Open packet capture
   if (load() == EXIT_FAILURE) return EXIT_FAILURE; //Load state
+  if (init_record() == EXIT_FAILURE) return EXIT_FAILURE; //Open match recording
+  app.next_tick = get_time_ns();
+
+  //Dedicated server, sleep between ticks instead of rendering
+  if (app.headless && init_tick_timer() == EXIT_FAILURE) return EXIT_FAILURE;
+  while (app.is_running && app.headless) {
+    wait_for_tick();
+    update_connection();
+    tick();
+    export_stats();
+    schedule_next_tick();
+  }
 
-
+  init_frame_pacer();
   while (app.is_running) {
-    poll_enet();
     poll_events();
-    update();
+    update_connection();
+    run_due_ticks();
     draw();
-    send_enet();
+    export_stats();
+    pace_frame();
   }
 
   return 0;